@@ -0,0 +1,147 @@
+/*
+ * WwuLang Compiler
+ *
+ * Writing and reading archives of compiled modules
+ */
+
+#include "archive.h"
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Support/Endian.h>
+
+namespace client
+{
+    static const char Magic[] = "WWLARC01";
+    static const std::uint64_t MagicSize = sizeof(Magic) - 1;
+
+    // Everything starts on a multiple of this
+    static const std::uint64_t Alignment = 8;
+
+    static std::uint64_t padding(std::uint64_t size)
+    {
+        return (Alignment - size % Alignment) % Alignment;
+    }
+
+    archive_writer::archive_writer(llvm::raw_ostream& out) : out(out)
+    {
+        out.write(Magic, MagicSize);
+    }
+
+    void archive_writer::add(llvm::StringRef name, llvm::StringRef bitcode)
+    {
+        char lengths[16];
+        llvm::support::endian::write64le(lengths, name.size());
+        llvm::support::endian::write64le(lengths + 8, bitcode.size());
+        out.write(lengths, sizeof(lengths));
+
+        out << name;
+        pad(name.size());
+        out << bitcode;
+        pad(bitcode.size());
+    }
+
+    void archive_writer::add(const llvm::Module& module)
+    {
+        llvm::SmallVector<char, 0> bitcode;
+        llvm::raw_svector_ostream bitcodeOut(bitcode);
+        llvm::WriteBitcodeToFile(module, bitcodeOut);
+
+        add(module.getName(), llvm::StringRef(bitcode.data(), bitcode.size()));
+    }
+
+    void archive_writer::pad(std::uint64_t size)
+    {
+        static const char zeros[Alignment] = { 0 };
+        out.write(zeros, padding(size));
+    }
+
+    // Get the next size bytes of the archive, and move past them and their
+    // padding. Returns false if they go past the end.
+    static bool take(llvm::StringRef data, std::uint64_t& position,
+        std::uint64_t size, llvm::StringRef& out)
+    {
+        std::uint64_t left = data.size() - position;
+
+        if (size > left || padding(size) > left - size)
+            return false;
+
+        out = data.substr(position, size);
+        position += size + padding(size);
+        return true;
+    }
+
+    bool archive_reader::open(const std::string& filename, std::string& error)
+    {
+        entries.clear();
+
+        // Big files are mapped rather than read
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> file =
+            llvm::MemoryBuffer::getFile(filename, false, false);
+
+        if (!file)
+        {
+            error = "could not open " + filename + ": " +
+                file.getError().message();
+            return false;
+        }
+
+        buffer = std::move(*file);
+        llvm::StringRef data = buffer->getBuffer();
+
+        if (!data.startswith(llvm::StringRef(Magic, MagicSize)))
+        {
+            error = filename + " isn't an archive";
+            return false;
+        }
+
+        // Go from one length to the next, checking that each one fits in
+        // what's left, which is what makes the lengths safe to use later
+        std::uint64_t position = MagicSize;
+
+        while (position < data.size())
+        {
+            entry e;
+
+            if (data.size() - position < 16)
+            {
+                error = filename + " is truncated";
+                return false;
+            }
+
+            const char* lengths = data.data() + position;
+            std::uint64_t nameSize = llvm::support::endian::read64le(lengths);
+            std::uint64_t bitcodeSize =
+                llvm::support::endian::read64le(lengths + 8);
+            position += 16;
+
+            if (!take(data, position, nameSize, e.name) ||
+                !take(data, position, bitcodeSize, e.bitcode))
+            {
+                error = filename + " is truncated";
+                return false;
+            }
+
+            entries.push_back(e);
+        }
+
+        return true;
+    }
+
+    std::unique_ptr<llvm::Module> archive_reader::load(std::size_t i,
+        llvm::LLVMContext& context, std::string& error) const
+    {
+        llvm::Expected<std::unique_ptr<llvm::Module>> module =
+            llvm::parseBitcodeFile(llvm::MemoryBufferRef(
+                entries[i].bitcode, entries[i].name), context);
+
+        if (!module)
+        {
+            error = llvm::toString(module.takeError());
+            return nullptr;
+        }
+
+        return std::move(*module);
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ * WwuLang Compiler
+ *
+ * Many compiled modules in one file, as bitcode, for tools that only need
+ * some of them to load just those
+ */
+
+#ifndef WWULANG_ARCHIVE_H
+#define WWULANG_ARCHIVE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace client
+{
+    // The modules are written one after the other, each with its length in
+    // front, so they can be written as they're compiled and a reader can
+    // skip straight over the ones it doesn't want. Everything is aligned
+    // to 8 bytes, so the file can be mapped and used where it is:
+    //
+    //   "WWLARC01"
+    //   for each module:
+    //     name length, bitcode length    64-bit little endian
+    //     name, bitcode                  each padded with zeros to 8 bytes
+    class archive_writer
+    {
+    public:
+        // Writes the header straight away
+        explicit archive_writer(llvm::raw_ostream& out);
+
+        // Add a module that's already bitcode, e.g. from another thread
+        void add(llvm::StringRef name, llvm::StringRef bitcode);
+
+        // Add a module, named after it
+        void add(const llvm::Module& module);
+
+    private:
+        void pad(std::uint64_t size);
+
+        llvm::raw_ostream& out;
+    };
+
+    // Maps an archive into memory and finds where each module is, without
+    // reading any of them
+    class archive_reader
+    {
+    public:
+        // Returns false with the reason in error if it can't be read or
+        // isn't an archive
+        bool open(const std::string& filename, std::string& error);
+
+        std::size_t size() const { return entries.size(); }
+        llvm::StringRef name(std::size_t i) const { return entries[i].name; }
+        llvm::StringRef bitcode(std::size_t i) const
+        {
+            return entries[i].bitcode;
+        }
+
+        // Load module i into the context, without reading any of the
+        // others. All of it is read now, since the JIT can't read a
+        // function's body later itself. Returns null with the reason in
+        // error if it isn't valid bitcode.
+        std::unique_ptr<llvm::Module> load(std::size_t i,
+            llvm::LLVMContext& context, std::string& error) const;
+
+    private:
+        struct entry
+        {
+            llvm::StringRef name;
+            llvm::StringRef bitcode;
+        };
+
+        std::unique_ptr<llvm::MemoryBuffer> buffer;
+        std::vector<entry> entries;
+    };
+}
+
+#endif
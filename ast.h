@@ -0,0 +1,248 @@
+/*
+ * WwuLang Compiler
+ *
+ * The Abstract Syntax Tree (AST) and printing it out
+ *
+ * References:
+ *
+ * Example used to figure out Spirit parsing and AST generation:
+ * http://boost.org/doc/libs/1_60_0/libs/spirit/example/qi/compiler_tutorial/calc4.cpp
+ */
+
+#ifndef WWULANG_AST_H
+#define WWULANG_AST_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <iostream>
+
+#include <boost/variant/recursive_variant.hpp>
+#include <boost/variant/apply_visitor.hpp>
+#include <boost/fusion/include/adapt_struct.hpp>
+
+// The Abstract Syntax Tree (AST)
+namespace client { namespace ast {
+    // This part may be nothing
+    struct nil {};
+
+    // This part may be an entire expression. The forward declaration since we
+    // have cyclic references (operand may be an expression, but an expression
+    // consists of operands).
+    struct expression;
+
+    // Each part of the tree may be any one of these types.
+    //
+    // Note: we'll postfix a name with an underscore when the name is
+    // reserved or we're declaring an instance of a class with the same
+    // name.
+    typedef boost::variant<
+        float,
+        std::string,
+        boost::recursive_wrapper<expression>
+    > operand;
+
+    // This part may consist of some operator (e.g. +) and then some other part
+    // of the expression, which may consist of another number (using the
+    // float variant), nothing if this is the end (using nil), etc.
+    struct operation
+    {
+        char operator_;
+        operand operand_;
+    };
+
+    // The topmost part will be an "expression", which consists of one or more
+    // things (nothing, numbers, or other expressions)
+    struct expression
+    {
+        operand first;
+        // Note: this means we'll be using the Kleene star as these in the
+        // AST have to correspond directly with how we describe what we
+        // can parse
+        std::vector<operation> rest;
+    };
+
+    // Define a variable to take on the value of an expression
+    struct assignment
+    {
+        std::string variable;
+        expression expression_;
+    };
+
+    // A program line can either be an assignment or an expression
+    //
+    // Note: we no longer have nothing since the program is a vector, so the
+    // "nothing" program can be represented by a program vector of length zero.
+    typedef boost::variant<
+        /*nil,*/
+        assignment,
+        expression
+    > program_line;
+
+    // A program can consist of multiple lines
+    typedef std::vector<program_line> program;
+}}
+
+// Makes this AST struct a "first-class fusion citizen that the grammar can
+// utilize." I.e., this is important. For some reason. Don't know why.
+BOOST_FUSION_ADAPT_STRUCT(
+    client::ast::operation,
+    (char, operator_) // Note: you get bizarre errors if you have a comma here
+    (client::ast::operand, operand_)
+)
+BOOST_FUSION_ADAPT_STRUCT(
+    client::ast::expression,
+    (client::ast::operand, first)
+    (std::vector<client::ast::operation>, rest)
+)
+BOOST_FUSION_ADAPT_STRUCT(
+    client::ast::assignment,
+    (std::string, variable)
+    (client::ast::expression, expression_)
+)
+
+// After we create the AST, process it in some manner
+namespace client { namespace ast {
+    // Output the AST visually
+    //
+    // We'll be creating one instance of this class and then calling the ()
+    // operators passing in the next item in the AST. This is called a
+    // 'functor' (nothing to do with that of category theory) or a 'function
+    // object.'
+    struct printer
+    {
+        typedef void result_type;
+
+        explicit printer(std::ostream& out = std::cout) : out(out) { }
+
+        // When we get nothing, do nothing
+        void operator()(nil) const { }
+
+        // If we get a number, print out the number
+        void operator()(float n) const
+        {
+            out << n;
+        }
+
+        // If we get a string, print out the variable name
+        void operator()(const std::string& s) const
+        {
+            out << s;
+        }
+
+        // If we get an "operation", which consists of an operator (e.g. +) and
+        // another operand
+        void operator()(const operation& x) const
+        {
+            // Continue looking at this subtree. E.g., if this operand is nil,
+            // then do nothing, but if it's a number, output it, etc.
+            boost::apply_visitor(*this, x.operand_);
+
+            // Display what operator this operation consisted of
+            switch (x.operator_)
+            {
+                case '+': out << " +"; break;
+                case '-': out << " -"; break;
+                case '*': out << " *"; break;
+                case '/': out << " /"; break;
+                default:  out << " ?"; break;
+            }
+        }
+
+        // If we got an expression, process the first part and then all the
+        // other parts as well, outputting spaces between
+        void operator()(const expression& x) const
+        {
+            boost::apply_visitor(*this, x.first);
+
+            for (const operation& op : x.rest)
+            {
+                out << " ";
+                (*this)(op);
+            }
+        }
+
+        // For an assignment, output that the result will be read into this
+        // variable
+        void operator()(const assignment& x) const
+        {
+            (*this)(x.expression_);
+            out << " =" << x.variable << " ";
+        }
+
+        // For the whole thing
+        void operator()(const program& x) const
+        {
+            // Don't just call (*this)(x) because then it'll call this same
+            // function creating an infinite loop. We want to call this
+            // function on what type it actually took on as part of the
+            // variant, i.e. whether it's an expression or assignment.
+            for (const program_line& line : x)
+                boost::apply_visitor(*this, line);
+        }
+
+        // Where to output to
+        std::ostream& out;
+    };
+
+    // Check whether two ASTs are exactly the same, e.g. whether two parsers
+    // agree on what some code means
+    struct comparer
+    {
+        typedef bool result_type;
+
+        // Different kinds of parts are never the same
+        template <typename A, typename B>
+        bool operator()(const A&, const B&) const { return false; }
+
+        // Compare the bits so NaN is the same as NaN
+        bool operator()(float a, float b) const
+        {
+            return std::memcmp(&a, &b, sizeof(float)) == 0;
+        }
+
+        bool operator()(const std::string& a, const std::string& b) const
+        {
+            return a == b;
+        }
+
+        bool operator()(const operation& a, const operation& b) const
+        {
+            return a.operator_ == b.operator_ &&
+                boost::apply_visitor(*this, a.operand_, b.operand_);
+        }
+
+        bool operator()(const expression& a, const expression& b) const
+        {
+            if (!boost::apply_visitor(*this, a.first, b.first) ||
+                a.rest.size() != b.rest.size())
+                return false;
+
+            for (std::size_t i = 0; i < a.rest.size(); ++i)
+                if (!(*this)(a.rest[i], b.rest[i]))
+                    return false;
+
+            return true;
+        }
+
+        bool operator()(const assignment& a, const assignment& b) const
+        {
+            return a.variable == b.variable &&
+                (*this)(a.expression_, b.expression_);
+        }
+
+        bool operator()(const program& a, const program& b) const
+        {
+            if (a.size() != b.size())
+                return false;
+
+            for (std::size_t i = 0; i < a.size(); ++i)
+                if (!boost::apply_visitor(*this, a[i], b[i]))
+                    return false;
+
+            return true;
+        }
+    };
+}}
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * WwuLang Compiler
+ *
+ * Optimizing the AST before it gets to LLVM
+ */
+
+#include "ast_optimizer.h"
+
+#include <cmath>
+#include <unordered_map>
+
+namespace client
+{
+    namespace
+    {
+        // Enough to tell two nodes apart: the kind and operator, then the
+        // value, name, or left-hand side, then the right-hand side
+        struct node_key
+        {
+            std::uint32_t kind;
+            std::uint32_t first;
+            std::uint32_t second;
+
+            bool operator==(const node_key& other) const
+            {
+                return kind == other.kind && first == other.first &&
+                    second == other.second;
+            }
+        };
+
+        struct node_key_hash
+        {
+            std::size_t operator()(const node_key& k) const
+            {
+                std::uint64_t h = k.kind;
+                h = h * 0x9e3779b97f4a7c15ULL + k.first;
+                h = h * 0x9e3779b97f4a7c15ULL + k.second;
+                return static_cast<std::size_t>(h ^ (h >> 32));
+            }
+        };
+
+        // Do the arithmetic like the generated code would. Returns whether
+        // the result can be stored in the AST without losing anything.
+        //
+        // With integers, only integers are folded, and only when nothing is
+        // rounded, so e.g. 7 / 2 is left for the code to round towards zero.
+        // Doubles are exact up to 2^53, which is well within 64 bits.
+        bool fold(char op, float lhs, float rhs, bool integers, float& result)
+        {
+            if (integers && (lhs != std::trunc(lhs) || rhs != std::trunc(rhs)))
+                return false;
+
+            double l = lhs;
+            double r = rhs;
+            double value;
+
+            switch (op)
+            {
+                case '+': value = l + r; break;
+                case '-': value = l - r; break;
+                case '*': value = l * r; break;
+                case '/': value = l / r; break;
+                default:  return false;
+            }
+
+            // NaNs don't compare equal to themselves, and which one we'd
+            // get isn't necessarily which one LLVM would
+            if (std::isnan(value) ||
+                static_cast<double>(static_cast<float>(value)) != value)
+                return false;
+
+            if (integers && (value != std::trunc(value) ||
+                    std::fabs(value) > 9007199254740992.0))
+                return false;
+
+            result = static_cast<float>(value);
+            return true;
+        }
+
+        // Builds up the optimized program one node at a time, giving back
+        // an existing node when there's already an identical one
+        class dag
+        {
+        public:
+            dag(flat::program& out, bool integers)
+                : out(out), integers(integers)
+            {
+                out.clear();
+            }
+
+            flat::index number(float value)
+            {
+                flat::node n;
+                n.kind = flat::node::number;
+                n.operator_ = 0;
+                n.value = value;
+                n.rhs = 0;
+                return find(n);
+            }
+
+            // A variable is whatever was last assigned to it. Otherwise it
+            // comes from outside the program, e.g. a parameter.
+            flat::index variable(flat::symbol name)
+            {
+                auto it = current.find(name);
+
+                if (it != current.end())
+                    return it->second;
+
+                flat::node n;
+                n.kind = flat::node::variable;
+                n.operator_ = 0;
+                n.name = name;
+                n.rhs = 0;
+                return find(n);
+            }
+
+            flat::index operation(char op, flat::index lhs, flat::index rhs)
+            {
+                const flat::node& l = out.nodes[lhs];
+                const flat::node& r = out.nodes[rhs];
+                float value;
+
+                if (l.kind == flat::node::number &&
+                    r.kind == flat::node::number &&
+                    fold(op, l.value, r.value, integers, value))
+                    return number(value);
+
+                flat::node n;
+                n.kind = flat::node::operation;
+                n.operator_ = op;
+                n.lhs = lhs;
+                n.rhs = rhs;
+                return find(n);
+            }
+
+            void assign(flat::symbol name, flat::index value)
+            {
+                if (current.find(name) == current.end())
+                    assigned.push_back(name);
+
+                current[name] = value;
+            }
+
+            // Start on another program, which has variables of its own.
+            // The nodes so far are kept, so it can share them.
+            void newProgram()
+            {
+                current.clear();
+                assigned.clear();
+            }
+
+            // Throw away the nodes that aren't needed and add the lines,
+            // one for each of the results
+            void finish(const std::vector<flat::index>& results,
+                bool keepAssignments)
+            {
+                std::vector<bool> needed(out.nodes.size(), false);
+
+                for (flat::index result : results)
+                    needed[result] = true;
+
+                if (keepAssignments)
+                    for (flat::symbol name : assigned)
+                        needed[current[name]] = true;
+
+                // Nodes only refer to ones before them, so going backwards
+                // we always know whether a node is needed by the time we
+                // get to it
+                for (std::size_t i = out.nodes.size(); i-- > 0; )
+                {
+                    const flat::node& n = out.nodes[i];
+
+                    if (needed[i] && n.kind == flat::node::operation)
+                    {
+                        needed[n.lhs] = true;
+                        needed[n.rhs] = true;
+                    }
+                }
+
+                // Then move the ones that are needed down to fill the gaps
+                std::vector<flat::index> moved(out.nodes.size());
+                flat::index next = 0;
+
+                for (std::size_t i = 0; i < out.nodes.size(); ++i)
+                {
+                    if (!needed[i])
+                        continue;
+
+                    flat::node n = out.nodes[i];
+
+                    if (n.kind == flat::node::operation)
+                    {
+                        n.lhs = moved[n.lhs];
+                        n.rhs = moved[n.rhs];
+                    }
+
+                    moved[i] = next;
+                    out.nodes[next++] = n;
+                }
+
+                out.nodes.resize(next);
+
+                if (keepAssignments)
+                    for (flat::symbol name : assigned)
+                        out.lines.push_back(flat::line{ name,
+                            moved[current[name]] });
+
+                for (flat::index result : results)
+                    out.lines.push_back(flat::line{ flat::no_symbol,
+                        moved[result] });
+            }
+
+            flat::program& out;
+
+            // Whether the arithmetic is done on 64-bit integers
+            bool integers;
+
+        private:
+            flat::index find(const flat::node& n)
+            {
+                node_key k;
+                k.kind = n.kind | static_cast<std::uint8_t>(n.operator_) << 8;
+                k.first = n.kind == flat::node::operation ? n.lhs :
+                    n.kind == flat::node::variable ? n.name :
+                    bits(n.value);
+                k.second = n.rhs;
+
+                auto result = existing.insert(std::make_pair(k,
+                    static_cast<flat::index>(out.nodes.size())));
+
+                if (result.second)
+                    out.add(n);
+
+                return result.first->second;
+            }
+
+            // Compare numbers by their bits so 0 and -0 aren't the same
+            static std::uint32_t bits(float value)
+            {
+                std::uint32_t b;
+                std::memcpy(&b, &value, sizeof(b));
+                return b;
+            }
+
+            std::unordered_map<node_key, flat::index, node_key_hash> existing;
+
+            // What each variable was last assigned, and the variables in the
+            // order they were first assigned
+            std::unordered_map<flat::symbol, flat::index> current;
+            std::vector<flat::symbol> assigned;
+        };
+
+        // Go through the tree AST adding everything to the DAG
+        struct tree_optimizer
+        {
+            typedef flat::index result_type;
+
+            flat::index operator()(float n) const
+            {
+                return d.number(n);
+            }
+
+            flat::index operator()(const std::string& s) const
+            {
+                return d.variable(d.out.symbols.intern(s));
+            }
+
+            flat::index operator()(const ast::expression& x) const
+            {
+                flat::index state = boost::apply_visitor(*this, x.first);
+
+                for (const ast::operation& op : x.rest)
+                    state = d.operation(op.operator_, state,
+                        boost::apply_visitor(*this, op.operand_));
+
+                return state;
+            }
+
+            flat::index operator()(const ast::assignment& x) const
+            {
+                flat::index value = (*this)(x.expression_);
+                d.assign(d.out.symbols.intern(x.variable), value);
+                return value;
+            }
+
+            dag& d;
+        };
+
+        // Likewise for the compact AST, though this is done with our own
+        // stack rather than recursing so there's no limit on how deep it can
+        // go. Each node is only added once per line, since what a variable is
+        // may change between lines.
+        class flat_optimizer
+        {
+        public:
+            flat_optimizer(dag& d, const flat::program& x)
+                : d(d), x(x), mapped(x.nodes.size()), line(x.nodes.size(), 0),
+                  lineNumber(0)
+            {
+            }
+
+            flat::index operator()(flat::index root)
+            {
+                ++lineNumber;
+                pending.push_back(root);
+
+                while (!pending.empty())
+                {
+                    flat::index n = pending.back();
+                    const flat::node& current = x.nodes[n];
+
+                    if (done(n))
+                    {
+                        pending.pop_back();
+                        continue;
+                    }
+
+                    // Both sides go first, the left-hand one on top
+                    if (current.kind == flat::node::operation &&
+                        !(done(current.lhs) && done(current.rhs)))
+                    {
+                        if (!done(current.rhs))
+                            pending.push_back(current.rhs);
+
+                        if (!done(current.lhs))
+                            pending.push_back(current.lhs);
+
+                        continue;
+                    }
+
+                    pending.pop_back();
+                    line[n] = lineNumber;
+
+                    switch (current.kind)
+                    {
+                        case flat::node::number:
+                            mapped[n] = d.number(current.value);
+                            break;
+
+                        case flat::node::variable:
+                            mapped[n] = d.variable(current.name);
+                            break;
+
+                        case flat::node::operation:
+                        default:
+                            mapped[n] = d.operation(current.operator_,
+                                mapped[current.lhs], mapped[current.rhs]);
+                            break;
+                    }
+                }
+
+                return mapped[root];
+            }
+
+        private:
+            bool done(flat::index n) const
+            {
+                return line[n] == lineNumber;
+            }
+
+            dag& d;
+            const flat::program& x;
+
+            // What each node became in the DAG, and on which line
+            std::vector<flat::index> mapped;
+            std::vector<std::size_t> line;
+            std::size_t lineNumber;
+            std::vector<flat::index> pending;
+        };
+    }
+
+    void optimizeAST(const ast::program& program, flat::program& out,
+        bool keepAssignments, bool integers)
+    {
+        dag d(out, integers);
+        tree_optimizer optimize{ d };
+        flat::index last = 0;
+
+        for (const ast::program_line& line : program)
+            last = boost::apply_visitor(optimize, line);
+
+        if (!program.empty())
+            d.finish({ last }, keepAssignments);
+    }
+
+    void optimizeAST(const flat::program& program, flat::program& out,
+        bool keepAssignments, bool integers)
+    {
+        dag d(out, integers);
+        flat_optimizer add(d, program);
+        flat::index last = 0;
+
+        for (const flat::line& l : program.lines)
+        {
+            last = add(l.root);
+
+            if (l.variable != flat::no_symbol)
+                d.assign(l.variable, last);
+        }
+
+        if (!program.lines.empty())
+            d.finish({ last }, keepAssignments);
+    }
+
+    void fuseAST(const std::vector<ast::program>& programs,
+        flat::program& out, bool integers)
+    {
+        dag d(out, integers);
+        tree_optimizer optimize{ d };
+        std::vector<flat::index> results;
+
+        for (const ast::program& program : programs)
+        {
+            flat::index last = 0;
+            d.newProgram();
+
+            for (const ast::program_line& line : program)
+                last = boost::apply_visitor(optimize, line);
+
+            results.push_back(last);
+        }
+
+        if (!results.empty())
+            d.finish(results, false);
+    }
+
+    void fuseAST(const std::vector<flat::program>& programs,
+        flat::program& out, bool integers)
+    {
+        dag d(out, integers);
+        std::vector<flat::index> results;
+
+        for (const flat::program& program : programs)
+        {
+            flat_optimizer add(d, program);
+            flat::index last = 0;
+            d.newProgram();
+
+            for (const flat::line& l : program.lines)
+            {
+                last = add(l.root);
+
+                if (l.variable != flat::no_symbol)
+                    d.assign(l.variable, last);
+            }
+
+            results.push_back(last);
+        }
+
+        if (!results.empty())
+            d.finish(results, false);
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * WwuLang Compiler
+ *
+ * Optimizing the AST before it gets to LLVM, which is much cheaper than
+ * running LLVM's passes over the IR it would have generated
+ */
+
+#ifndef WWULANG_AST_OPTIMIZER_H
+#define WWULANG_AST_OPTIMIZER_H
+
+#include "ast.h"
+#include "flat_ast.h"
+
+namespace client
+{
+    // Optimize the program into out, which is cleared first. Since the
+    // programs are straight-line code, this can be done in one pass:
+    //
+    //  - Operators on two numbers are replaced with the result, as long as
+    //    that's exactly a float. Code generation does the arithmetic on
+    //    doubles (or floats, which give the same answer whenever it's
+    //    exactly a float), so otherwise folding would change the answer. If
+    //    integers is set, for code doing the arithmetic on 64-bit integers,
+    //    only results that are exactly integers are folded.
+    //  - Identical subexpressions become the same node, so e.g. a*b in
+    //    (a*b)+(a*b) is only computed once. Variables are replaced with
+    //    what was last assigned to them, so this works across lines and
+    //    reassigning a variable is handled.
+    //  - Only what the last line needs is kept, so assignments to variables
+    //    it doesn't read are dropped along with any errors in them. If
+    //    keepAssignments is set, e.g. in a session where the variables
+    //    outlive the program, the last value of each variable is kept, too.
+    //
+    // The result is a compact AST in which nodes may be shared. Shared nodes
+    // come before the nodes using them, which is all flat::compiler needs to
+    // compile each of them once.
+    void optimizeAST(const ast::program& program, flat::program& out,
+        bool keepAssignments = false, bool integers = false);
+    void optimizeAST(const flat::program& program, flat::program& out,
+        bool keepAssignments = false, bool integers = false);
+
+    // Optimize many programs together into out, e.g. formulas worked out
+    // from the same inputs, so anything they have in common is computed
+    // once for all of them. Each program's variables are its own, other
+    // than the ones it uses without assigning, which are inputs shared by
+    // all of them. out has one line per program with its value, in order.
+    // None of the programs can be empty.
+    void fuseAST(const std::vector<ast::program>& programs,
+        flat::program& out, bool integers = false);
+    void fuseAST(const std::vector<flat::program>& programs,
+        flat::program& out, bool integers = false);
+}
+
+#endif
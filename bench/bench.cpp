@@ -0,0 +1,726 @@
+/*
+ * WwuLang Compiler
+ *
+ * Benchmarks for each stage of compiling on generated programs, so we can
+ * see what a change does to performance before it goes in. The output has
+ * one line per shape, size, and stage in a fixed order so that the results
+ * from two versions can be diffed.
+ *
+ * It can also put load on a compile server started with --serve, to see
+ * how many requests it answers per second and how long they take, or
+ * compare how long programs from the library take to give their first
+ * answer and then each one after, when they're compiled straight away,
+ * only interpreted, or interpreted until they've been called enough times.
+ * Or it can run the programs in an archive from --emit=archive, to check
+ * they come back out the way they went in.
+ *
+ * Usage:
+ *   bench [-O<level>] [--ssa] [--pairwise] [--fast-math] [--reps <n>]
+ *         [--shape <shape>] [--size <n>]...
+ *   bench --generate <shape> <size>
+ *   bench --fuzz <count> <seed>
+ *   bench --run-archive <file>
+ *   bench --load <socket> [--connections <n>] [--requests <n>] [--compile]
+ *         [--shape <shape>] [--size <n>]
+ *   bench --tiered [-O<level>] [--calls <n>] [--threshold <n>]
+ *         [--shape <shape>] [--size <n>]...
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "ast.h"
+#include "grammar.h"
+#include "parser.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "jit.h"
+#include "archive.h"
+#include "server.h"
+#include "wwulang.h"
+
+typedef std::string::const_iterator iterator_type;
+typedef client::calculator<iterator_type> calculator;
+
+// The kinds of programs we generate. Each one stresses something different.
+static const char* const Shapes[] = {
+    // a=1.5;a+1+a+2+... - one long chain of additions
+    "chain",
+    // a=1.5;((...(a+1)+1...)+1) - deeply nested parenthesis
+    "nest",
+    // v0=1.5;v1=v0+1;v2=v1*0.5;... - many assignments depending on each other
+    "assign",
+    // v0=0;v1=1;...;v0+v1+... - many variables used at once
+    "wide"
+};
+
+// The stages we time, in the order they're output
+enum stage
+{
+    SpiritParse,
+    FastParse,
+    Codegen,
+    Verify,
+    Optimize,
+    Emit,
+    JIT,
+    Execute,
+    // Added after the others so older results still line up
+    EmitBitcode,
+    StageCount
+};
+
+static const char* const StageNames[StageCount] = {
+    "spirit_parse",
+    "fast_parse",
+    "codegen",
+    "verify",
+    "optimize",
+    "emit",
+    "jit",
+    "execute",
+    "emit_bitcode"
+};
+
+// How many times to call the compiled function when timing execution, since
+// once is too quick to measure
+static const int ExecuteCalls = 1000;
+
+// Create a program of the given shape. Size is roughly how many operators
+// it has. The same shape and size always gives the same program.
+static bool generate(const std::string& shape, int size, std::string& out)
+{
+    std::ostringstream s;
+
+    if (shape == "chain")
+    {
+        s << "a=1.5;a";
+
+        for (int i = 1; i <= size; ++i)
+            s << (i % 2 ? "+" : "-") << i << "+a";
+    }
+    else if (shape == "nest")
+    {
+        s << "a=1.5;" << std::string(size, '(') << "a";
+
+        for (int i = 0; i < size; ++i)
+            s << (i % 2 ? "*a)" : "+1)");
+    }
+    else if (shape == "assign")
+    {
+        s << "v0=1.5";
+
+        for (int i = 1; i < size; ++i)
+            s << ";v" << i << "=v" << i - 1 << (i % 2 ? "+1" : "*0.5");
+
+        s << ";v" << std::max(size - 1, 0);
+    }
+    else if (shape == "wide")
+    {
+        for (int i = 0; i < size; ++i)
+            s << "v" << i << "=" << i << ";";
+
+        s << "v0";
+
+        for (int i = 1; i < size; ++i)
+            s << "+v" << i;
+    }
+    else
+    {
+        std::cerr << "Error: unknown shape " << shape << std::endl;
+        return false;
+    }
+
+    out = s.str();
+    return true;
+}
+
+// Pieces of programs, valid or not, for fuzz() to string together. Along
+// with the tokens there are numbers Spirit's float_ takes that a parser
+// might not, and things neither should take.
+static const char* const FuzzTokens[] = {
+    "a", "b", "x1", "2a", "0", "1", "1.5", ".5", "1.", "1e3", "1e", "-1",
+    "inf", "nan", "+", "-", "*", "/", "(", ")", "=", ";", " ", "\t", "$"
+};
+
+// Output count programs of random tokens, one per line. Most of them don't
+// parse, which is the point: the parsers have to agree on where they stop,
+// too. The same count and seed always gives the same programs.
+static void fuzz(int count, unsigned int seed, std::ostream& out)
+{
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> length(1, 20);
+    std::uniform_int_distribution<std::size_t> token(0,
+        std::end(FuzzTokens) - std::begin(FuzzTokens) - 1);
+
+    for (int i = 0; i < count; ++i)
+    {
+        for (int n = length(random); n > 0; --n)
+            out << FuzzTokens[token(random)];
+
+        out << "\n";
+    }
+}
+
+// Nanoseconds since some point, for timing
+static std::uint64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Compile and run the program once, adding how long each stage took to
+// times. Returns false (after outputting an error) if anything failed.
+static bool runOnce(CompilerContext& ctx, client::jit& jit,
+    const calculator& calc, const std::string& str,
+    std::vector<std::uint64_t> (&times)[StageCount])
+{
+    ctx.reset();
+    ctx.TheModule->setDataLayout(jit.getDataLayout());
+
+    // Spirit, which is what we compile from so both parsers are comparable
+    // with what's been measured before
+    client::ast::program ast;
+    std::uint64_t start = now();
+    iterator_type iter = str.begin();
+    iterator_type end = str.end();
+    boost::spirit::ascii::space_type space;
+    bool r = phrase_parse(iter, end, calc, space, ast);
+    times[SpiritParse].push_back(now() - start);
+
+    if (!r || iter != end)
+    {
+        std::cerr << "Error: Spirit failed to parse" << std::endl;
+        return false;
+    }
+
+    // The hand-written parser, thrown away afterwards
+    {
+        client::ast::program fastAST;
+        start = now();
+        const char* first = str.data();
+        r = client::parse_fast(first, str.data() + str.size(), fastAST);
+        times[FastParse].push_back(now() - start);
+
+        if (!r || first != str.data() + str.size())
+        {
+            std::cerr << "Error: fast parser failed to parse" << std::endl;
+            return false;
+        }
+    }
+
+    llvm::Function* mainFunction = createMainPrototype(ctx);
+
+    start = now();
+    client::ast::compiler compile(ctx);
+    llvm::Value* body = compile(ast);
+    times[Codegen].push_back(now() - start);
+
+    start = now();
+    llvm::Function* program = createMainFunction(ctx, body, mainFunction);
+    times[Verify].push_back(now() - start);
+
+    if (!program)
+    {
+        std::cerr << "Error: " << (ctx.Error.empty() ? "failed to compile" :
+            ctx.Error) << std::endl;
+        return false;
+    }
+
+    start = now();
+    optimizeModule(*ctx.TheModule, ctx.OptLevel, ctx.Target.get());
+    times[Optimize].push_back(now() - start);
+
+    // What the compiler does when it isn't running the code
+    {
+        std::string ir;
+        start = now();
+        llvm::raw_string_ostream out(ir);
+        ctx.TheModule->print(out, nullptr);
+        out.flush();
+        times[Emit].push_back(now() - start);
+    }
+
+    // Or what it writes for an archive
+    {
+        llvm::SmallVector<char, 0> bitcode;
+        start = now();
+        llvm::raw_svector_ostream out(bitcode);
+        llvm::WriteBitcodeToFile(*ctx.TheModule, out);
+        times[EmitBitcode].push_back(now() - start);
+    }
+
+    start = now();
+    llvm::orc::ResourceTrackerSP tracker = jit.add(std::move(ctx.TheModule),
+        std::move(ctx.TheContext));
+    llvm::JITTargetAddress address = tracker ? jit.lookup(MainName) : 0;
+    times[JIT].push_back(now() - start);
+
+    if (!address)
+    {
+        if (tracker)
+            llvm::consumeError(tracker->remove());
+
+        return false;
+    }
+
+    double (*func)() = reinterpret_cast<double (*)()>(
+        static_cast<intptr_t>(address));
+    volatile double result = 0;
+
+    start = now();
+    for (int i = 0; i < ExecuteCalls; ++i)
+        result = result + func();
+    times[Execute].push_back((now() - start) / ExecuteCalls);
+
+    if (llvm::Error removeError = tracker->remove())
+    {
+        std::cerr << "Error: " << llvm::toString(std::move(removeError))
+            << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// The middle time, which isn't thrown off by the odd slow run
+static std::uint64_t median(std::vector<std::uint64_t>& times)
+{
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+// Send the program to the server as fast as it answers from this many
+// connections at once, each on its own thread, until it's been sent the
+// given number of times. The program is evaluated unless compile is set, in
+// which case the server just sends back the IR.
+static int runLoad(const std::string& socket, const std::string& program,
+    bool compile, int connections, int requests)
+{
+    std::string request = (compile ? "c" : "e") + program;
+
+    // How long each request took, from each connection
+    std::vector<std::vector<std::uint64_t>> latencies(connections);
+    std::atomic<int> next(0);
+    std::atomic<int> errors(0);
+    std::atomic<bool> failed(false);
+
+    auto client = [&](std::vector<std::uint64_t>* times)
+    {
+        int fd = client::connectTo(socket);
+
+        if (fd < 0)
+        {
+            failed = true;
+            return;
+        }
+
+        std::string response;
+
+        while (next++ < requests)
+        {
+            std::uint64_t start = now();
+
+            if (!client::writeMessage(fd, request) ||
+                !client::readMessage(fd, response))
+            {
+                std::cerr << "Error: the server closed the connection"
+                    << std::endl;
+                failed = true;
+                break;
+            }
+
+            times->push_back(now() - start);
+
+            if (response.compare(0, 3, "ok\n") != 0)
+                ++errors;
+        }
+
+        close(fd);
+    };
+
+    std::uint64_t start = now();
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < connections; ++i)
+        threads.emplace_back(client, &latencies[i]);
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    std::uint64_t elapsed = now() - start;
+
+    if (failed)
+        return 1;
+
+    std::vector<std::uint64_t> all;
+
+    for (const std::vector<std::uint64_t>& times : latencies)
+        all.insert(all.end(), times.begin(), times.end());
+
+    std::sort(all.begin(), all.end());
+
+    auto percentile = [&](double p)
+    {
+        return all[std::min(all.size() - 1,
+            static_cast<std::size_t>(p * all.size()))] / 1000;
+    };
+
+    std::cout << "# wwulang load " << (compile ? "compile" : "evaluate")
+        << " connections=" << connections << std::endl
+        << "requests     " << all.size() << std::endl
+        << "errors       " << errors << std::endl
+        << "rps          " << static_cast<std::uint64_t>(
+            all.size() * 1e9 / elapsed) << std::endl
+        << "p50_us       " << percentile(0.5) << std::endl
+        << "p99_us       " << percentile(0.99) << std::endl
+        << "max_us       " << all.back() / 1000 << std::endl;
+
+    return errors ? 1 : 0;
+}
+
+// Call the program from the library the given number of times, with the
+// variable it assigns first as a parameter instead so it can't all be
+// folded away. It's compiled straight away ("native"), never ("interpret"),
+// or after threshold calls ("tiered"), or straight away and then
+// specialized for the argument, which never changes, after specializeAfter
+// calls ("specialized"). Returns false (after outputting an error) if it
+// didn't compile.
+static bool runTieredOnce(const std::string& program, unsigned int optLevel,
+    unsigned int threshold, unsigned int specializeAfter, int calls,
+    std::uint64_t& first, std::uint64_t& mean)
+{
+    std::size_t equals = program.find('=');
+    std::size_t end = program.find(';');
+    std::string param = program.substr(0, equals);
+    const char* params[] = { param.c_str(), nullptr };
+
+    wwl_options opts;
+    wwl_default_options(&opts);
+    opts.opt_level = optLevel;
+    opts.jit_threshold = threshold;
+    opts.specialize_after = specializeAfter;
+
+    double arg = 1.5;
+    volatile double result = 0;
+    std::uint64_t start = now();
+    wwl_program* compiled = wwl_compile(program.c_str() + end + 1, params,
+        &opts);
+
+    if (!compiled)
+    {
+        std::cerr << "Error: " << wwl_error() << std::endl;
+        return false;
+    }
+
+    result = result + wwl_call(compiled, &arg);
+    first = now() - start;
+
+    start = now();
+    for (int i = 1; i < calls; ++i)
+        result = result + wwl_call(compiled, &arg);
+    mean = (now() - start) / std::max(calls - 1, 1);
+
+    wwl_free(compiled);
+    return true;
+}
+
+// Load each program in the archive and run it, outputting its result like
+// the REPL does, so it can be compared with running the batch with --jit
+static int runArchive(const std::string& filename)
+{
+    client::archive_reader archive;
+    std::string error;
+
+    if (!archive.open(filename, error))
+    {
+        std::cerr << "Error: " << error << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<client::jit> jit = client::jit::create();
+
+    if (!jit)
+        return 1;
+
+    for (std::size_t i = 0; i < archive.size(); ++i)
+    {
+        std::unique_ptr<llvm::LLVMContext> context(new llvm::LLVMContext);
+        std::unique_ptr<llvm::Module> module = archive.load(i, *context,
+            error);
+        double result;
+
+        if (!module)
+        {
+            std::cerr << "Error: " << archive.name(i).str() << ": " << error
+                << std::endl;
+            return 1;
+        }
+
+        if (!jit->run(std::move(module), std::move(context),
+                archive.name(i).str(), result))
+            return 1;
+
+        std::cout << "Result: " << result << std::endl;
+    }
+
+    return 0;
+}
+
+static int runTiered(const std::vector<std::string>& shapes,
+    const std::vector<int>& sizes, unsigned int optLevel, int calls,
+    unsigned int threshold)
+{
+    static const char* const Modes[] = { "native", "interpret", "tiered",
+        "specialized" };
+    const unsigned int thresholds[] = { 0, UINT_MAX, threshold, 0 };
+    const unsigned int specializeAfter[] = { 0, 0, 0, threshold };
+
+    std::cout << "# wwulang tiered -O" << optLevel << " calls=" << calls
+        << " threshold=" << threshold << std::endl
+        << "# shape size mode first_call_ns mean_ns" << std::endl;
+
+    for (const std::string& shape : shapes)
+    {
+        for (int size : sizes)
+        {
+            std::string program;
+
+            if (!generate(shape, size, program))
+                return 1;
+
+            for (int mode = 0; mode < 4; ++mode)
+            {
+                std::uint64_t first;
+                std::uint64_t mean;
+
+                if (!runTieredOnce(program, optLevel, thresholds[mode],
+                        specializeAfter[mode], calls, first, mean))
+                    return 1;
+
+                std::cout << std::left << std::setw(8) << shape << " "
+                    << std::right << std::setw(6) << size << "  "
+                    << std::left << std::setw(10) << Modes[mode] << " "
+                    << std::right << std::setw(12) << first << " "
+                    << std::setw(10) << mean << std::endl;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [-O<level>] [--ssa] [--pairwise]"
+        << " [--fast-math] [--reps <n>]" << std::endl
+        << "       " << std::string(std::strlen(name), ' ')
+        << " [--shape <shape>] [--size <n>]..." << std::endl
+        << "       " << name << " --generate <shape> <size>" << std::endl
+        << "       " << name << " --fuzz <count> <seed>" << std::endl
+        << "       " << name << " --run-archive <file>" << std::endl
+        << "       " << name << " --load <socket> [--connections <n>]"
+        << " [--requests <n>] [--compile]" << std::endl
+        << "       " << std::string(std::strlen(name), ' ')
+        << " [--shape <shape>] [--size <n>]" << std::endl
+        << "       " << name << " --tiered [-O<level>] [--calls <n>]"
+        << " [--threshold <n>]" << std::endl
+        << "       " << std::string(std::strlen(name), ' ')
+        << " [--shape <shape>] [--size <n>]..." << std::endl
+        << "Shapes: chain, nest, assign, wide" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int optLevel = 2;
+    bool ssa = false;
+    bool pairwise = false;
+    bool fastMath = false;
+    int reps = 11;
+    std::vector<std::string> shapes;
+    std::vector<int> sizes;
+
+    // For putting load on a server
+    std::string loadSocket;
+    int connections = 4;
+    int requests = 10000;
+    bool compile = false;
+
+    // For comparing interpreting with compiling in the library
+    bool tiered = false;
+    int calls = 100000;
+    unsigned int threshold = 1000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--generate" && i + 2 < argc)
+        {
+            // Just output the program, e.g. to try it with the compiler
+            std::string program;
+
+            if (!generate(argv[i + 1], std::atoi(argv[i + 2]), program))
+                return 1;
+
+            std::cout << program << std::endl;
+            return 0;
+        }
+        else if (arg == "--run-archive" && i + 1 < argc)
+        {
+            return runArchive(argv[i + 1]);
+        }
+        else if (arg == "--fuzz" && i + 2 < argc)
+        {
+            fuzz(std::atoi(argv[i + 1]), std::strtoul(argv[i + 2], nullptr, 10),
+                std::cout);
+            return 0;
+        }
+        else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 &&
+            arg[2] >= '0' && arg[2] <= '3')
+        {
+            optLevel = arg[2] - '0';
+        }
+        else if (arg == "--ssa")
+        {
+            ssa = true;
+        }
+        else if (arg == "--pairwise")
+        {
+            pairwise = true;
+        }
+        else if (arg == "--fast-math")
+        {
+            fastMath = true;
+        }
+        else if (arg == "--reps" && i + 1 < argc)
+        {
+            reps = std::max(std::atoi(argv[++i]), 1);
+        }
+        else if (arg == "--load" && i + 1 < argc)
+        {
+            loadSocket = argv[++i];
+        }
+        else if (arg == "--connections" && i + 1 < argc)
+        {
+            connections = std::max(std::atoi(argv[++i]), 1);
+        }
+        else if (arg == "--requests" && i + 1 < argc)
+        {
+            requests = std::max(std::atoi(argv[++i]), 1);
+        }
+        else if (arg == "--compile")
+        {
+            compile = true;
+        }
+        else if (arg == "--tiered")
+        {
+            tiered = true;
+        }
+        else if (arg == "--calls" && i + 1 < argc)
+        {
+            calls = std::max(std::atoi(argv[++i]), 1);
+        }
+        else if (arg == "--threshold" && i + 1 < argc)
+        {
+            threshold = std::max(std::atoi(argv[++i]), 1);
+        }
+        else if (arg == "--shape" && i + 1 < argc)
+        {
+            shapes.push_back(argv[++i]);
+        }
+        else if (arg == "--size" && i + 1 < argc)
+        {
+            sizes.push_back(std::max(std::atoi(argv[++i]), 1));
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!loadSocket.empty())
+    {
+        // Only one program, by default a short formula like most of ours
+        std::string program;
+
+        if (!generate(shapes.empty() ? "chain" : shapes[0],
+                sizes.empty() ? 10 : sizes[0], program))
+            return 1;
+
+        return runLoad(loadSocket, program, compile, connections, requests);
+    }
+
+    if (shapes.empty())
+        shapes.assign(std::begin(Shapes), std::end(Shapes));
+
+    if (sizes.empty())
+        sizes = { 10, 100, 1000 };
+
+    if (tiered)
+        return runTiered(shapes, sizes, optLevel, calls, threshold);
+
+    std::unique_ptr<client::jit> jit = client::jit::create();
+
+    if (!jit)
+        return 1;
+
+    calculator calc;
+    CompilerContext ctx(optLevel);
+    ctx.SSA = ssa;
+    ctx.Rebalance = pairwise || fastMath;
+    ctx.FastMath = fastMath;
+
+    // Median nanoseconds per program, so smaller is better. Only the
+    // numbers should change between versions, not the lines.
+    std::cout << "# wwulang bench -O" << optLevel << (ssa ? " ssa" : "")
+        << (fastMath ? " fast-math" : pairwise ? " pairwise" : "")
+        << " reps=" << reps
+        << std::endl
+        << "# shape size stage median_ns" << std::endl;
+
+    for (const std::string& shape : shapes)
+    {
+        for (int size : sizes)
+        {
+            std::string program;
+
+            if (!generate(shape, size, program))
+                return 1;
+
+            std::vector<std::uint64_t> times[StageCount];
+
+            for (int rep = 0; rep < reps; ++rep)
+                if (!runOnce(ctx, *jit, calc, program, times))
+                    return 1;
+
+            for (int s = 0; s < StageCount; ++s)
+                std::cout << std::left << std::setw(8) << shape << " "
+                    << std::right << std::setw(6) << size << "  "
+                    << std::left << std::setw(12) << StageNames[s] << " "
+                    << std::right << std::setw(12) << median(times[s])
+                    << std::endl;
+        }
+    }
+
+    return 0;
+}
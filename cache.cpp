@@ -0,0 +1,259 @@
+/*
+ * WwuLang Compiler
+ *
+ * A cache on disk of programs we've already compiled
+ */
+
+#include "cache.h"
+
+#include <vector>
+#include <cstring>
+#include <utility>
+#include <algorithm>
+#include <iostream>
+
+#include <utime.h>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace client
+{
+    // What the files are named, e.g. <hash>.bc
+    static const char* const extension = ".bc";
+
+    compile_cache::compile_cache(const std::string& directory,
+        std::uint64_t maxBytes)
+        : directory(directory), maxBytes(maxBytes), totalBytes(0),
+          hitCount(0), missCount(0), evictionCount(0)
+    {
+        if (std::error_code ec = llvm::sys::fs::create_directories(directory))
+            std::cerr << "Error: could not create cache directory "
+                << directory << ": " << ec.message() << std::endl;
+
+        // Find what's already there, oldest first, so the order is right
+        std::vector<std::pair<llvm::sys::TimePoint<>, std::string>> found;
+        std::vector<std::uint64_t> sizes;
+        std::error_code ec;
+
+        for (llvm::sys::fs::directory_iterator it(directory, ec), end;
+            it != end && !ec; it.increment(ec))
+        {
+            llvm::StringRef name = llvm::sys::path::filename(it->path());
+
+            if (!name.endswith(extension))
+                continue;
+
+            llvm::sys::fs::file_status status;
+
+            if (llvm::sys::fs::status(it->path(), status))
+                continue;
+
+            found.emplace_back(status.getLastModificationTime(),
+                name.drop_back(std::strlen(extension)).str());
+            sizes.push_back(status.getSize());
+        }
+
+        std::vector<std::size_t> byAge(found.size());
+
+        for (std::size_t i = 0; i < byAge.size(); ++i)
+            byAge[i] = i;
+
+        std::sort(byAge.begin(), byAge.end(),
+            [&](std::size_t a, std::size_t b)
+            {
+                return found[a].first < found[b].first;
+            });
+
+        for (std::size_t i : byAge)
+        {
+            order.push_front(found[i].second);
+            entries[found[i].second] = entry{ sizes[i], order.begin() };
+            totalBytes += sizes[i];
+        }
+
+        // In case the maximum is smaller than last time
+        std::lock_guard<std::mutex> lock(mutex);
+        evict();
+    }
+
+    std::string compile_cache::key(llvm::StringRef source,
+        const std::string& options)
+    {
+        // Whether this character could be part of a number or a name, in
+        // which case removing the whitespace between two of them would join
+        // them into one, e.g. "a b" into "ab". A unary sign followed by a
+        // number is also different without the space, e.g. "3*- 5" isn't
+        // valid but "3*-5" is, which a binary one isn't, e.g. "1 - 2" is
+        // "1-2".
+        auto word = [](char c)
+        {
+            return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                (c >= 'A' && c <= 'Z') || c == '.';
+        };
+        auto space = [](char c)
+        {
+            return c == ' ' || (c >= '\t' && c <= '\r');
+        };
+
+        std::string normalized;
+        normalized.reserve(source.size());
+
+        for (std::size_t i = 0; i < source.size(); ++i)
+        {
+            if (!space(source[i]))
+            {
+                normalized += source[i];
+                continue;
+            }
+
+            while (i + 1 < source.size() && space(source[i + 1]))
+                ++i;
+
+            char before = normalized.empty() ? 0 : normalized.back();
+            char after = i + 1 < source.size() ? source[i + 1] : 0;
+
+            // A sign is unary if it doesn't follow an operand, i.e. it's at
+            // the start or follows an operator, parenthesis, = or ;
+            bool unary = false;
+
+            if (before == '+' || before == '-')
+            {
+                std::size_t sign = normalized.size() - 1;
+
+                if (sign > 0 && normalized[sign - 1] == ' ')
+                    --sign;
+
+                unary = sign == 0 ||
+                    std::strchr("+-*/(=;", normalized[sign - 1]);
+            }
+
+            if ((word(before) || unary) && word(after))
+                normalized += ' ';
+        }
+
+        llvm::SHA1 hash;
+        hash.update(LLVM_VERSION_STRING);
+        hash.update(llvm::StringRef("\0", 1));
+        hash.update(options);
+        hash.update(llvm::StringRef("\0", 1));
+        hash.update(normalized);
+
+        return llvm::toHex(hash.final(), true);
+    }
+
+    std::string compile_cache::path(const std::string& key) const
+    {
+        llvm::SmallString<128> result(directory);
+        llvm::sys::path::append(result, key + extension);
+        return result.str().str();
+    }
+
+    std::unique_ptr<llvm::Module> compile_cache::lookup(const std::string& key,
+        llvm::LLVMContext& context)
+    {
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+            llvm::MemoryBuffer::getFile(path(key));
+
+        if (!buffer)
+        {
+            ++missCount;
+            return nullptr;
+        }
+
+        llvm::Expected<std::unique_ptr<llvm::Module>> module =
+            llvm::parseBitcodeFile((*buffer)->getMemBufferRef(), context);
+
+        // E.g. if it was only partially written, treat it as not there
+        if (!module)
+        {
+            llvm::consumeError(module.takeError());
+            ++missCount;
+            return nullptr;
+        }
+
+        ++hitCount;
+        touch(key);
+
+        return std::move(*module);
+    }
+
+    void compile_cache::store(const std::string& key, const llvm::Module& module)
+    {
+        // Write it somewhere else first and then move it into place, so
+        // nobody ever reads a half-written file
+        std::string final = path(key);
+        llvm::SmallString<128> temporary;
+        int fd;
+
+        if (llvm::sys::fs::createUniqueFile(final + ".%%%%%%.tmp", fd,
+                temporary))
+            return;
+
+        std::uint64_t size;
+
+        {
+            llvm::raw_fd_ostream out(fd, true);
+            llvm::WriteBitcodeToFile(module, out);
+            size = out.tell();
+        }
+
+        if (llvm::sys::fs::rename(temporary, final))
+        {
+            llvm::sys::fs::remove(temporary);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+
+        // Somebody else may have just compiled the same thing
+        if (it != entries.end())
+        {
+            totalBytes -= it->second.size;
+            order.erase(it->second.order);
+            entries.erase(it);
+        }
+
+        order.push_front(key);
+        entries[key] = entry{ size, order.begin() };
+        totalBytes += size;
+
+        evict();
+    }
+
+    void compile_cache::touch(const std::string& key)
+    {
+        // So another process also knows this was used recently
+        utime(path(key).c_str(), nullptr);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+
+        if (it != entries.end())
+            order.splice(order.begin(), order, it->second.order);
+    }
+
+    void compile_cache::evict()
+    {
+        while (totalBytes > maxBytes && !order.empty())
+        {
+            const std::string& oldest = order.back();
+            auto it = entries.find(oldest);
+
+            llvm::sys::fs::remove(path(oldest));
+            totalBytes -= it->second.size;
+            entries.erase(it);
+            order.pop_back();
+
+            ++evictionCount;
+        }
+    }
+}
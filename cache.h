@@ -0,0 +1,84 @@
+/*
+ * WwuLang Compiler
+ *
+ * A cache on disk of programs we've already compiled, so compiling the same
+ * program again skips parsing, code generation, and optimization
+ */
+
+#ifndef WWULANG_CACHE_H
+#define WWULANG_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+namespace client
+{
+    // Each compiled module is stored as bitcode in its own file in the
+    // directory, named by the hash of the key. When the files add up to
+    // more than the maximum size, the least recently used ones are deleted.
+    //
+    // This can be used from multiple threads at once.
+    class compile_cache
+    {
+    public:
+        compile_cache(const std::string& directory, std::uint64_t maxBytes);
+
+        // The key for some source code compiled with some options (anything
+        // that changes the generated code, e.g. the optimization level).
+        // Whitespace is removed where it doesn't matter, so formatting a
+        // program differently doesn't make it a different program. The LLVM
+        // version is part of it too.
+        static std::string key(llvm::StringRef source,
+            const std::string& options);
+
+        // Returns null if the program isn't in the cache
+        std::unique_ptr<llvm::Module> lookup(const std::string& key,
+            llvm::LLVMContext& context);
+
+        void store(const std::string& key, const llvm::Module& module);
+
+        std::uint64_t hits() const { return hitCount; }
+        std::uint64_t misses() const { return missCount; }
+        std::uint64_t evictions() const { return evictionCount; }
+
+    private:
+        std::string path(const std::string& key) const;
+
+        // Delete files until we're under the maximum size
+        void evict();
+
+        // Mark as used most recently
+        void touch(const std::string& key);
+
+        struct entry
+        {
+            std::uint64_t size;
+            std::list<std::string>::iterator order;
+        };
+
+        std::string directory;
+        std::uint64_t maxBytes;
+
+        // Guards everything below
+        std::mutex mutex;
+        std::unordered_map<std::string, entry> entries;
+        // Most recently used first
+        std::list<std::string> order;
+        std::uint64_t totalBytes;
+
+        std::atomic<std::uint64_t> hitCount;
+        std::atomic<std::uint64_t> missCount;
+        std::atomic<std::uint64_t> evictionCount;
+    };
+}
+
+#endif
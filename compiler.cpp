@@ -0,0 +1,1202 @@
+/*
+ * WwuLang Compiler
+ *
+ * Going from the AST to LLVM IR
+ */
+
+#include "compiler.h"
+#include "optimizer.h"
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <cassert>
+
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/raw_ostream.h>
+
+CompilerContext::CompilerContext(unsigned int optLevel)
+    : SSA(false), Builder(nullptr), Rebalance(false), FastMath(false),
+      Numeric(client::numeric_kind::f64), Arithmetic(client::numeric_kind::f64),
+      OptLevel(optLevel), Kernel(false), Fused(false), KernelIndex(nullptr),
+      Profile(nullptr), Session(false)
+{
+    if (OptLevel > 0)
+        Target = createHostTargetMachine(OptLevel);
+
+    reset();
+}
+
+void CompilerContext::reset()
+{
+    // The old builder and module have to go before the context they were
+    // created in
+    Builder = nullptr;
+    NoFoldBuilder.reset();
+    FoldBuilder.reset();
+    TheModule.reset();
+    NamedValues.clear();
+    CurrentValues.clear();
+    Columns.clear();
+    ColumnValues.clear();
+    KernelIndex = nullptr;
+    NewGlobals.clear();
+    Error.clear();
+    Arithmetic = Numeric == client::numeric_kind::auto_ ?
+        client::numeric_kind::f64 : Numeric;
+
+    TheContext = std::make_unique<llvm::LLVMContext>();
+    TheModule = std::make_unique<llvm::Module>(
+            "WwuLang JIT Compiler", *TheContext);
+
+    if (Target)
+    {
+        TheModule->setTargetTriple(Target->getTargetTriple().str());
+        TheModule->setDataLayout(Target->createDataLayout());
+    }
+
+    // Only leave the constant expressions in the IR when we aren't
+    // optimizing anyway
+    if (OptLevel == 0)
+    {
+        NoFoldBuilder = std::make_unique<llvm::IRBuilder<llvm::NoFolder>>(
+            *TheContext);
+        Builder = NoFoldBuilder.get();
+    }
+    else
+    {
+        FoldBuilder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+        Builder = FoldBuilder.get();
+    }
+
+    // Everything but reassociating, since the reassociate pass would turn
+    // the balanced trees back into chains
+    if (FastMath)
+    {
+        llvm::FastMathFlags flags;
+        flags.setFast();
+        flags.setAllowReassoc(false);
+        Builder->setFastMathFlags(flags);
+    }
+}
+
+// Record an error and return null rather than a valid LLVM Value pointer
+llvm::Value* ErrorV(CompilerContext& ctx, const char *s)
+{
+    if (ctx.Error.empty())
+        ctx.Error = s;
+
+    return nullptr;
+}
+
+// The LLVM type for numbers of the kind. Auto is stored as doubles.
+static llvm::Type* kindType(llvm::LLVMContext& context,
+    client::numeric_kind kind)
+{
+    switch (kind)
+    {
+        case client::numeric_kind::f32: return llvm::Type::getFloatTy(context);
+        case client::numeric_kind::i64: return llvm::Type::getInt64Ty(context);
+        default:                        return llvm::Type::getDoubleTy(context);
+    }
+}
+
+// What the arithmetic is done in
+static llvm::Type* numberType(CompilerContext& ctx)
+{
+    return kindType(*ctx.TheContext, ctx.Arithmetic);
+}
+
+// What kernel columns and session variables are stored as, which has to be
+// the same for every program, not just this one
+static llvm::Type* storageType(CompilerContext& ctx)
+{
+    return kindType(*ctx.TheContext, ctx.Numeric);
+}
+
+// Whether the arithmetic is on integers rather than floating point
+static bool integerArithmetic(const CompilerContext& ctx)
+{
+    return ctx.Arithmetic == client::numeric_kind::i64;
+}
+
+// Convert a number to another type, if it isn't already. Going to an
+// integer rounds towards zero, and saturates rather than being undefined
+// for NaNs and numbers too big for it.
+static llvm::Value* convertNumber(CompilerContext& ctx, llvm::Value* value,
+    llvm::Type* type)
+{
+    llvm::Type* from = value->getType();
+
+    if (from == type)
+        return value;
+
+    if (from->isIntegerTy())
+        return ctx.Builder->CreateSIToFP(value, type, "convtmp");
+
+    if (type->isIntegerTy())
+        return ctx.Builder->CreateIntrinsic(llvm::Intrinsic::fptosi_sat,
+            { type, from }, { value }, nullptr, "convtmp");
+
+    return ctx.Builder->CreateFPCast(value, type, "convtmp");
+}
+
+// A number in the type the arithmetic is done in. The AST stores numbers as
+// floats, which doubles hold exactly, but integers only if it is one.
+static llvm::Value* createNumber(CompilerContext& ctx, float n)
+{
+    llvm::Type* type = numberType(ctx);
+
+    if (!type->isIntegerTy())
+        return llvm::ConstantFP::get(type, static_cast<double>(n));
+
+    if (n != std::trunc(n) || std::fabs(n) >= 9223372036854775808.0)
+        return ErrorV(ctx, "Number isn't a 64-bit integer");
+
+    return llvm::ConstantInt::get(type, static_cast<std::int64_t>(n), true);
+}
+
+// Integer division by zero, or of the smallest integer by -1, is undefined,
+// so rather than letting LLVM assume neither happens, x / 0 is 0 and x / -1
+// is -x, wrapping around like the other operators
+static llvm::Value* createDivision(CompilerContext& ctx, llvm::Value* lhs,
+    llvm::Value* rhs)
+{
+    llvm::Type* type = rhs->getType();
+    llvm::Value* zero = ctx.Builder->CreateICmpEQ(rhs,
+        llvm::ConstantInt::get(type, 0), "zero");
+    llvm::Value* minusOne = ctx.Builder->CreateICmpEQ(rhs,
+        llvm::ConstantInt::get(type, -1, true), "minusone");
+    llvm::Value* divisor = ctx.Builder->CreateSelect(
+        ctx.Builder->CreateOr(zero, minusOne, "unsafe"),
+        llvm::ConstantInt::get(type, 1),
+        rhs, "divisor");
+    llvm::Value* quotient = ctx.Builder->CreateSDiv(lhs, divisor, "divtmp");
+
+    quotient = ctx.Builder->CreateSelect(minusOne,
+        ctx.Builder->CreateNeg(quotient, "negtmp"), quotient, "divtmp");
+    return ctx.Builder->CreateSelect(zero, llvm::ConstantInt::get(type, 0),
+        quotient, "divtmp");
+}
+
+// Create the operator for whatever type the numbers are. Integers wrap
+// around when they overflow.
+static llvm::Value* createOperation(CompilerContext& ctx, char op,
+    llvm::Value* lhs, llvm::Value* rhs)
+{
+    if (lhs->getType()->isIntegerTy())
+    {
+        switch (op)
+        {
+            case '+': return ctx.Builder->CreateAdd(lhs, rhs, "addtmp");
+            case '-': return ctx.Builder->CreateSub(lhs, rhs, "subtmp");
+            case '*': return ctx.Builder->CreateMul(lhs, rhs, "multmp");
+            case '/': return createDivision(ctx, lhs, rhs);
+            default:  return ErrorV(ctx, "invalid binary operator");
+        }
+    }
+
+    switch (op)
+    {
+        case '+': return ctx.Builder->CreateFAdd(lhs, rhs, "addtmp");
+        case '-': return ctx.Builder->CreateFSub(lhs, rhs, "subtmp");
+        case '*': return ctx.Builder->CreateFMul(lhs, rhs, "multmp");
+        case '/': return ctx.Builder->CreateFDiv(lhs, rhs, "divtmp");
+        default:  return ErrorV(ctx, "invalid binary operator");
+    }
+}
+
+// One of the values in a chain, and whether it's subtracted (or divided by)
+// rather than added (or multiplied by)
+typedef std::pair<llvm::Value*, bool> chain_term;
+
+// Whether the operator is + or -, rather than * or /
+static bool isAdditive(char op)
+{
+    return op == '+' || op == '-';
+}
+
+// Combine the terms from begin to end by splitting them in half, combining
+// each half, and then combining the two results. Subtracting is like adding
+// a negative, so a - b + c - d becomes (a - b) + (c - d), and when both
+// halves are negative, e.g. -b - d, that's -(b + d).
+static chain_term balanceChain(CompilerContext& ctx, bool additive,
+    const std::vector<chain_term>& terms, std::size_t begin, std::size_t end)
+{
+    if (end - begin == 1)
+        return terms[begin];
+
+    std::size_t middle = begin + (end - begin) / 2;
+    chain_term lhs = balanceChain(ctx, additive, terms, begin, middle);
+    chain_term rhs = balanceChain(ctx, additive, terms, middle, end);
+
+    if (lhs.second == rhs.second)
+        return chain_term(createOperation(ctx, additive ? '+' : '*',
+            lhs.first, rhs.first), lhs.second);
+
+    if (rhs.second)
+        std::swap(lhs, rhs);
+
+    return chain_term(createOperation(ctx, additive ? '-' : '/',
+        rhs.first, lhs.first), false);
+}
+
+// Whether a chain with this operator can be rebalanced. a / b / c becomes
+// a / (b * c), and b * c can overflow or underflow when a / b / c wouldn't,
+// so that's only done with fast math. For integers, where b * c wraps
+// around when it overflows, it's never done.
+static bool canRebalance(const CompilerContext& ctx, char op)
+{
+    return op != '/' || (ctx.FastMath && !integerArithmetic(ctx));
+}
+
+// Evaluate first op terms[1] op terms[2] ... as a balanced tree rather than
+// left to right. The operators are all either + and - or * and /, and the
+// first term is never subtracted since it's the first.
+static llvm::Value* createChain(CompilerContext& ctx, char op,
+    const std::vector<chain_term>& terms)
+{
+    chain_term result = balanceChain(ctx, isAdditive(op), terms, 0,
+        terms.size());
+
+    // The half with the first term in it is never negative, so neither is
+    // the whole thing
+    assert(!result.second);
+    return result.first;
+}
+
+namespace client { namespace ast {
+    // From LLVM example
+    //
+    // Create an alloca instruction in the entry block of the function. This
+    // is used for mutable variables
+    static llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* func,
+        llvm::StringRef variableName, llvm::Type* type)
+    {
+        llvm::IRBuilder<> TmpBuilder(&func->getEntryBlock(),
+            func->getEntryBlock().begin());
+        return TmpBuilder.CreateAlloca(type, 0, variableName);
+    }
+
+    // If we get a number, create an LLVM number of the type the arithmetic
+    // is done in, so it matches the variables
+    llvm::Value* compiler::operator()(float n) const
+    {
+        return createNumber(ctx, n);
+    }
+
+    // If we get a string, it's a variable name
+    llvm::Value* compiler::operator()(const std::string& s) const
+    {
+        // In SSA form the variable is just its current value
+        if (ctx.SSA)
+        {
+            std::map<std::string, llvm::Value*>::const_iterator it =
+                ctx.CurrentValues.find(s);
+
+            if (it != ctx.CurrentValues.end() && it->second)
+                return it->second;
+        }
+        // Look up the variable name
+        else
+        {
+            std::map<std::string, llvm::AllocaInst*>::const_iterator it =
+                ctx.NamedValues.find(s);
+
+            // Load the value from memory
+            if (it != ctx.NamedValues.end() && it->second)
+                return ctx.Builder->CreateLoad(it->second->getAllocatedType(),
+                        it->second, s.c_str());
+        }
+
+        // In a kernel or fused function it's one of the inputs
+        if (ctx.Kernel)
+            return loadColumn(ctx, s);
+
+        if (ctx.Fused)
+            return loadInput(ctx, s);
+
+        // In a session it may be from an earlier program. In SSA form we
+        // only need to load it once.
+        if (ctx.Session)
+        {
+            llvm::Value* value = loadGlobal(ctx, s);
+
+            if (ctx.SSA)
+                ctx.CurrentValues[s] = value;
+
+            return value;
+        }
+
+        return ErrorV(ctx, "Unknown variable name");
+    }
+
+    // If we get an "operation", which consists of an operator (e.g. +) and
+    // another operand
+    llvm::Value* compiler::operator()(const operation& x, llvm::Value* lhs) const
+    {
+        // Ignore if left-hand side null
+        if (!lhs)
+            return nullptr;
+
+        // Continue looking at this subtree. E.g., if this operand is nil,
+        // then do nothing, but if it's a number, make it floating point,
+        // etc.
+        llvm::Value* rhs = boost::apply_visitor(*this, x.operand_);
+
+        // Ignore if right-hand side null
+        if (!rhs)
+            return nullptr;
+
+        // Create the appropriate operation of the left- and right-hand
+        // sides
+        return createOperation(ctx, x.operator_, lhs, rhs);
+    }
+
+    // If we got an expression, process the first part and then all the
+    // other parts as well
+    llvm::Value* compiler::operator()(const expression& x) const
+    {
+        // Each expression the parser creates is a chain of only + and -, or
+        // only * and /, so when rebalancing, evaluate all the parts and then
+        // combine them
+        if (ctx.Rebalance && x.rest.size() > 1 &&
+            std::all_of(x.rest.begin(), x.rest.end(),
+                [&](const operation& op)
+                {
+                    return isAdditive(op.operator_) ==
+                        isAdditive(x.rest.front().operator_) &&
+                        canRebalance(ctx, op.operator_);
+                }))
+        {
+            std::vector<chain_term> terms;
+            terms.reserve(x.rest.size() + 1);
+            terms.emplace_back(boost::apply_visitor(*this, x.first), false);
+
+            for (const operation& op : x.rest)
+            {
+                if (!terms.back().first)
+                    return nullptr;
+
+                terms.emplace_back(boost::apply_visitor(*this, op.operand_),
+                    op.operator_ == '-' || op.operator_ == '/');
+            }
+
+            if (!terms.back().first)
+                return nullptr;
+
+            return createChain(ctx, x.rest.front().operator_, terms);
+        }
+
+        llvm::Value* state = boost::apply_visitor(*this, x.first);
+
+        for (const operation& op : x.rest)
+            state = (*this)(op, state);
+
+        return state;
+    }
+
+    // For an assignment, create the variable
+    llvm::Value* compiler::operator()(const assignment& x) const
+    {
+        // Look at what is on the right side of the assignment operator
+        llvm::Value* expression = (*this)(x.expression_);
+
+        // In SSA form, from now on the variable is this value. Reassigning
+        // it just replaces it.
+        if (expression && ctx.SSA)
+        {
+            ctx.CurrentValues[x.variable] = expression;
+
+            if (ctx.Session)
+                storeGlobal(ctx, x.variable, expression);
+        }
+        // Only allocate memory and store the value if the expression
+        // evaluated, not if it returned null
+        else if (expression)
+        {
+            // We'll be adding the allocations to the function we're in,
+            // i.e. main or the kernel
+            llvm::Function* func = ctx.Builder->GetInsertBlock()->getParent();
+
+            // Create a variable and save the result to it
+            llvm::AllocaInst* alloca = CreateEntryBlockAlloca(func, x.variable,
+                expression->getType());
+            ctx.Builder->CreateStore(expression, alloca);
+            ctx.NamedValues[x.variable] = alloca;
+
+            if (ctx.Session)
+                storeGlobal(ctx, x.variable, expression);
+        }
+
+        // Also return this expression so we don't get a failed-to-compile
+        // error
+        return expression;
+    }
+
+    // For the whole thing, return whatever was the last value
+    llvm::Value* compiler::operator()(const program& x) const
+    {
+        llvm::Value* lastValue = nullptr;
+
+        for (const program_line& line : x)
+            lastValue = boost::apply_visitor(*this, line);
+
+        return lastValue;
+    }
+}}
+
+namespace client { namespace flat {
+    llvm::Value* compiler::operator()(const program& x)
+    {
+        // Start with any variables that already exist, e.g. parameters,
+        // interning them all before we know how many symbols there are
+        std::vector<std::pair<symbol, llvm::AllocaInst*>> existing;
+        std::vector<std::pair<symbol, llvm::Value*>> existingSSA;
+
+        for (const auto& value : ctx.NamedValues)
+            existing.emplace_back(x.symbols.intern(value.first), value.second);
+
+        for (const auto& value : ctx.CurrentValues)
+            existingSSA.emplace_back(x.symbols.intern(value.first), value.second);
+
+        values.assign(x.symbols.size(), nullptr);
+        ssaValues.assign(x.symbols.size(), nullptr);
+
+        for (const auto& value : existing)
+            values[value.first] = value.second;
+
+        for (const auto& value : existingSSA)
+            ssaValues[value.first] = value.second;
+
+        nodeValues.assign(x.nodes.size(), nullptr);
+
+        if (ctx.Rebalance)
+        {
+            uses.assign(x.nodes.size(), 0);
+
+            for (const node& n : x.nodes)
+            {
+                if (n.kind == node::operation)
+                {
+                    ++uses[n.lhs];
+                    ++uses[n.rhs];
+                }
+            }
+
+            for (const line& l : x.lines)
+                ++uses[l.root];
+        }
+
+        llvm::Value* lastValue = nullptr;
+        lineValues.clear();
+
+        for (const line& l : x.lines)
+        {
+            lastValue = (*this)(x, l.root);
+            lineValues.push_back(lastValue);
+
+            // For an assignment, create the variable, but only if the
+            // expression evaluated
+            if (l.variable != no_symbol && lastValue && ctx.SSA)
+            {
+                ssaValues[l.variable] = lastValue;
+
+                if (ctx.Session)
+                    storeGlobal(ctx, x.symbols.name(l.variable), lastValue);
+            }
+            else if (l.variable != no_symbol && lastValue)
+            {
+                llvm::Function* func = ctx.Builder->GetInsertBlock()->getParent();
+
+                llvm::AllocaInst* alloca = ast::CreateEntryBlockAlloca(func,
+                    x.symbols.name(l.variable), lastValue->getType());
+                ctx.Builder->CreateStore(lastValue, alloca);
+                values[l.variable] = alloca;
+
+                if (ctx.Session)
+                    storeGlobal(ctx, x.symbols.name(l.variable), lastValue);
+            }
+        }
+
+        return lastValue;
+    }
+
+    llvm::Value* compiler::operator()(const program& x, index n)
+    {
+        // Compile what each node needs before the node itself, keeping track
+        // of what's left with our own stack rather than recursing, since a
+        // chain like a + b + c + ... is as deep as it is long
+        pending.push_back(n);
+
+        while (!pending.empty())
+        {
+            index i = pending.back();
+
+            if (nodeValues[i])
+            {
+                pending.pop_back();
+                continue;
+            }
+
+            // Anything it needs that isn't compiled yet goes first, with
+            // the left-most on top so it's compiled first
+            operands(x, i);
+            std::size_t needed = pending.size();
+
+            for (auto it = parts.rbegin(); it != parts.rend(); ++it)
+                if (!nodeValues[it->first])
+                    pending.push_back(it->first);
+
+            if (pending.size() != needed)
+                continue;
+
+            pending.pop_back();
+            nodeValues[i] = compile(x, i);
+
+            // Don't bother with the rest if any of it failed
+            if (!nodeValues[i])
+            {
+                pending.clear();
+                return nullptr;
+            }
+        }
+
+        return nodeValues[n];
+    }
+
+    void compiler::operands(const program& x, index n)
+    {
+        const node& current = x.nodes[n];
+        parts.clear();
+
+        if (current.kind != node::operation)
+            return;
+
+        if (ctx.Rebalance)
+        {
+            // Go down the left side of the tree, since that's how a chain is
+            // stored, e.g. a + b + c is (a + b) + c
+            bool additive = isAdditive(current.operator_);
+            bool rebalance = true;
+            index i = n;
+
+            while (x.nodes[i].kind == node::operation &&
+                isAdditive(x.nodes[i].operator_) == additive &&
+                (i == n || uses[i] == 1))
+            {
+                char op = x.nodes[i].operator_;
+                parts.emplace_back(x.nodes[i].rhs, op == '-' || op == '/');
+                rebalance = rebalance && canRebalance(ctx, op);
+                i = x.nodes[i].lhs;
+            }
+
+            // In order from the first one
+            if (parts.size() > 1 && rebalance)
+            {
+                parts.emplace_back(i, false);
+                std::reverse(parts.begin(), parts.end());
+                return;
+            }
+
+            parts.clear();
+        }
+
+        parts.emplace_back(current.lhs, false);
+        parts.emplace_back(current.rhs, false);
+    }
+
+    llvm::Value* compiler::compile(const program& x, index n)
+    {
+        const node& current = x.nodes[n];
+
+        switch (current.kind)
+        {
+            case node::number:
+                return createNumber(ctx, current.value);
+
+            case node::variable:
+            {
+                if (ctx.SSA && ssaValues[current.name])
+                    return ssaValues[current.name];
+
+                llvm::AllocaInst* alloca = ctx.SSA ? nullptr :
+                    values[current.name];
+
+                if (!alloca)
+                {
+                    if (ctx.Kernel)
+                        return loadColumn(ctx, x.symbols.name(current.name));
+
+                    if (ctx.Fused)
+                        return loadInput(ctx, x.symbols.name(current.name));
+
+                    if (ctx.Session && ctx.SSA)
+                        return ssaValues[current.name] =
+                            loadGlobal(ctx, x.symbols.name(current.name));
+
+                    if (ctx.Session)
+                        return loadGlobal(ctx, x.symbols.name(current.name));
+
+                    return ErrorV(ctx, "Unknown variable name");
+                }
+
+                return ctx.Builder->CreateLoad(alloca->getAllocatedType(),
+                    alloca, x.symbols.name(current.name));
+            }
+
+            case node::operation:
+            {
+                // By now everything it needs has been compiled
+                if (parts.size() > 2)
+                {
+                    std::vector<chain_term> terms;
+                    terms.reserve(parts.size());
+
+                    for (const auto& part : parts)
+                        terms.emplace_back(nodeValues[part.first], part.second);
+
+                    return createChain(ctx, current.operator_, terms);
+                }
+
+                return createOperation(ctx, current.operator_,
+                    nodeValues[current.lhs], nodeValues[current.rhs]);
+            }
+        }
+
+        return nullptr;
+    }
+}}
+
+// A pointer to memory that's already there, e.g. the profile
+static llvm::Value* address(CompilerContext& ctx, const void* p)
+{
+    llvm::Type* int64Type = llvm::Type::getInt64Ty(*ctx.TheContext);
+
+    return llvm::ConstantExpr::getIntToPtr(llvm::ConstantInt::get(int64Type,
+        reinterpret_cast<std::uintptr_t>(p)), int64Type->getPointerTo());
+}
+
+// Load or store one of the profile's counters. They're atomic so other
+// threads don't see anything torn, but only monotonic since nothing else
+// depends on them.
+static llvm::Value* loadCounter(CompilerContext& ctx, llvm::Value* counter,
+    const llvm::Twine& name)
+{
+    llvm::LoadInst* load = ctx.Builder->CreateAlignedLoad(
+        llvm::Type::getInt64Ty(*ctx.TheContext), counter, llvm::Align(8), name);
+    load->setAtomic(llvm::AtomicOrdering::Monotonic);
+    return load;
+}
+
+static void storeCounter(CompilerContext& ctx, llvm::Value* value,
+    llvm::Value* counter)
+{
+    ctx.Builder->CreateAlignedStore(value, counter, llvm::Align(8))->setAtomic(
+        llvm::AtomicOrdering::Monotonic);
+}
+
+// Count the call and vote for each argument's value in the profile, see
+// value_profile. There are no branches, so it doesn't get in the way of
+// optimizing the rest.
+static void profileArguments(CompilerContext& ctx, llvm::Function* func)
+{
+    client::value_profile& profile = *ctx.Profile;
+    llvm::Type* int64Type = llvm::Type::getInt64Ty(*ctx.TheContext);
+    llvm::Value* one = llvm::ConstantInt::get(int64Type, 1);
+    llvm::Value* zero = llvm::ConstantInt::get(int64Type, 0);
+
+    llvm::Value* calls = address(ctx, &profile.calls);
+    storeCounter(ctx, ctx.Builder->CreateAdd(loadCounter(ctx, calls, "calls"),
+        one), calls);
+
+    for (std::size_t i = 0; i < func->arg_size() &&
+            i < profile.values.size(); ++i)
+    {
+        llvm::Value* bitsCounter = address(ctx, &profile.values[i].bits);
+        llvm::Value* leadCounter = address(ctx, &profile.values[i].lead);
+
+        llvm::Value* bits = ctx.Builder->CreateBitCast(func->getArg(i),
+            int64Type, "bits");
+        llvm::Value* leader = loadCounter(ctx, bitsCounter, "leader");
+        llvm::Value* lead = loadCounter(ctx, leadCounter, "lead");
+
+        // With no lead, this value takes over. Either way it adds to the
+        // lead if it's the leader, and takes from it if not.
+        llvm::Value* none = ctx.Builder->CreateICmpEQ(lead, zero, "none");
+        llvm::Value* same = ctx.Builder->CreateOr(none,
+            ctx.Builder->CreateICmpEQ(bits, leader), "same");
+
+        storeCounter(ctx, ctx.Builder->CreateSelect(none, bits, leader),
+            bitsCounter);
+        storeCounter(ctx, ctx.Builder->CreateSelect(same,
+            ctx.Builder->CreateAdd(lead, one),
+            ctx.Builder->CreateSub(lead, one)), leadCounter);
+    }
+}
+
+// We need to create the prototype and the entry point before compiling the
+// code since during an assignment it adds allocations to this entry point.
+llvm::Function* createMainPrototype(CompilerContext& ctx,
+        const std::vector<std::string>& params)
+{
+    // Make the function type: double(double, ...), usually just double()
+    llvm::Type* doubleType = llvm::Type::getDoubleTy(*ctx.TheContext);
+    std::vector<llvm::Type*> arguments(params.size(), doubleType);
+    llvm::FunctionType* functionType = llvm::FunctionType::get(
+        doubleType, arguments, false);
+    llvm::Function* func = llvm::Function::Create(
+        functionType, llvm::Function::ExternalLinkage, MainName, ctx.TheModule.get());
+
+    // Create a new basic block to start insertion into
+    llvm::BasicBlock* basicBlock = llvm::BasicBlock::Create(
+        *ctx.TheContext, "entry", func);
+    ctx.Builder->SetInsertPoint(basicBlock);
+
+    for (std::size_t i = 0; i < params.size(); ++i)
+        func->getArg(i)->setName(params[i]);
+
+    if (ctx.Profile)
+        profileArguments(ctx, func);
+
+    // Store the arguments in variables, like an assignment does, or the
+    // value it's specialized for, which the optimizer can then fold
+    for (std::size_t i = 0; i < params.size(); ++i)
+    {
+        auto specialized = ctx.Specialized.find(params[i]);
+        llvm::Value* value = specialized == ctx.Specialized.end() ?
+            static_cast<llvm::Value*>(func->getArg(i)) :
+            llvm::ConstantFP::get(doubleType, specialized->second);
+        value = convertNumber(ctx, value, numberType(ctx));
+
+        if (ctx.SSA)
+        {
+            ctx.CurrentValues[params[i]] = value;
+            continue;
+        }
+
+        llvm::AllocaInst* alloca = client::ast::CreateEntryBlockAlloca(func,
+            params[i], value->getType());
+        ctx.Builder->CreateStore(value, alloca);
+        ctx.NamedValues[params[i]] = alloca;
+    }
+
+    return func;
+}
+
+// Take some code, e.g. assignment, and wrap it in a main function so that
+// it'll actually be able to do something
+llvm::Function* createMainFunction(CompilerContext& ctx, llvm::Value* body,
+        llvm::Function* func)
+{
+    // If we don't get the function directly, try to find it
+    if (!func)
+    {
+        // See if we've already created the prototype
+        func = ctx.TheModule->getFunction(MainName);
+
+        // If it doesn't exist, create it
+        if (!func)
+            func = createMainPrototype(ctx);
+
+        // For some reason couldn't generate the prototype
+        if (!func)
+            return nullptr;
+    }
+
+    // Create a new basic block to start insertion into if the prototype
+    // didn't already give us one. Otherwise we'd end up with an entry block
+    // without a terminator and a second one with no predecessors.
+    if (func->empty())
+    {
+        llvm::BasicBlock* basicBlock = llvm::BasicBlock::Create(
+            *ctx.TheContext, "entry", func);
+        ctx.Builder->SetInsertPoint(basicBlock);
+    }
+
+    // Create body through parsing the actual code
+    llvm::Value* returnValue = body;
+
+    if (returnValue)
+    {
+        // Finish off the function, returning a double whatever the
+        // arithmetic was done in
+        ctx.Builder->CreateRet(convertNumber(ctx, returnValue,
+            func->getReturnType()));
+
+        // Validate the generated code, checking for consistency. This
+        // returns true if the function is broken.
+        if (!llvm::verifyFunction(*func, &llvm::errs()))
+            return func;
+    }
+
+    // Error reading body, remove function
+    func->eraseFromParent();
+    return nullptr;
+}
+
+llvm::Function* createGuard(CompilerContext& ctx, llvm::Function* main,
+        const std::string& name, const std::string& generic,
+        const std::vector<std::string>& params)
+{
+    llvm::LLVMContext& context = *ctx.TheContext;
+    llvm::Type* int64Type = llvm::Type::getInt64Ty(context);
+    llvm::FunctionType* functionType = main->getFunctionType();
+
+    main->setLinkage(llvm::Function::InternalLinkage);
+
+    llvm::Function* fallback = ctx.TheModule->getFunction(generic);
+
+    if (!fallback)
+        fallback = llvm::Function::Create(functionType,
+            llvm::Function::ExternalLinkage, generic, ctx.TheModule.get());
+
+    llvm::Function* guard = llvm::Function::Create(functionType,
+        llvm::Function::ExternalLinkage, name, ctx.TheModule.get());
+
+    llvm::BasicBlock* entry = llvm::BasicBlock::Create(context, "entry", guard);
+    llvm::BasicBlock* fast = llvm::BasicBlock::Create(context, "specialized",
+        guard);
+    llvm::BasicBlock* slow = llvm::BasicBlock::Create(context, "generic",
+        guard);
+
+    // Whether every specialized argument is exactly its value
+    ctx.Builder->SetInsertPoint(entry);
+    llvm::Value* matches = llvm::ConstantInt::getTrue(context);
+    std::vector<llvm::Value*> args;
+
+    for (std::size_t i = 0; i < params.size(); ++i)
+    {
+        llvm::Argument* argument = guard->getArg(i);
+        argument->setName(params[i]);
+        args.push_back(argument);
+
+        auto specialized = ctx.Specialized.find(params[i]);
+
+        if (specialized == ctx.Specialized.end())
+            continue;
+
+        llvm::Value* bits = ctx.Builder->CreateBitCast(argument, int64Type);
+        llvm::Value* expected = llvm::ConstantExpr::getBitCast(
+            llvm::ConstantFP::get(argument->getType(), specialized->second),
+            int64Type);
+        matches = ctx.Builder->CreateAnd(matches,
+            ctx.Builder->CreateICmpEQ(bits, expected), "matches");
+    }
+
+    // It was specialized because that's what the arguments nearly always
+    // are
+    ctx.Builder->CreateCondBr(matches, fast, slow,
+        llvm::MDBuilder(context).createBranchWeights(2000, 1));
+
+    ctx.Builder->SetInsertPoint(fast);
+    ctx.Builder->CreateRet(ctx.Builder->CreateCall(main, args));
+
+    ctx.Builder->SetInsertPoint(slow);
+    llvm::CallInst* call = ctx.Builder->CreateCall(fallback, args);
+    call->setTailCall();
+    ctx.Builder->CreateRet(call);
+
+    if (llvm::verifyFunction(*guard, &llvm::errs()))
+    {
+        guard->eraseFromParent();
+        return nullptr;
+    }
+
+    return guard;
+}
+
+// Where the names of the columns are saved in the module
+static const char* const ColumnsMetadata = "wwulang.columns";
+
+// Where the names of a fused function's outputs are saved in the module
+static const char* const OutputsMetadata = "wwulang.outputs";
+
+// Save the names in the module as metadata
+static void addNames(CompilerContext& ctx, const char* metadata,
+    const std::vector<std::string>& names)
+{
+    llvm::LLVMContext& context = *ctx.TheContext;
+    llvm::NamedMDNode* node = ctx.TheModule->getOrInsertNamedMetadata(metadata);
+
+    for (const std::string& name : names)
+        node->addOperand(llvm::MDNode::get(context,
+            llvm::MDString::get(context, name)));
+}
+
+// The names saved by addNames()
+static std::vector<std::string> getNames(const llvm::Module& module,
+    const char* metadata)
+{
+    std::vector<std::string> names;
+    const llvm::NamedMDNode* node = module.getNamedMetadata(metadata);
+
+    if (node)
+        for (const llvm::MDNode* name : node->operands())
+            names.push_back(llvm::cast<llvm::MDString>(
+                name->getOperand(0))->getString().str());
+
+    return names;
+}
+
+llvm::Function* createKernelPrototype(CompilerContext& ctx)
+{
+    llvm::LLVMContext& context = *ctx.TheContext;
+    llvm::Type* elementType = storageType(ctx);
+    llvm::Type* sizeType = ctx.TheModule->getDataLayout().getIntPtrType(context);
+    llvm::PointerType* columnType = llvm::PointerType::get(elementType, 0);
+
+    // Make the function type: void(const double**, double*, size_t), or
+    // with floats or integers instead of doubles
+    std::vector<llvm::Type*> arguments = {
+        llvm::PointerType::get(columnType, 0), columnType, sizeType };
+    llvm::FunctionType* functionType = llvm::FunctionType::get(
+        llvm::Type::getVoidTy(context), arguments, false);
+    llvm::Function* func = llvm::Function::Create(
+        functionType, llvm::Function::ExternalLinkage, KernelName, ctx.TheModule.get());
+
+    llvm::Argument* in = func->getArg(0);
+    llvm::Argument* out = func->getArg(1);
+    llvm::Argument* n = func->getArg(2);
+    in->setName("in");
+    out->setName("out");
+    n->setName("n");
+
+    // Let LLVM know that writing the output can't change the inputs, or it
+    // would have to reload them for every row
+    in->addAttr(llvm::Attribute::NoAlias);
+    in->addAttr(llvm::Attribute::ReadOnly);
+    in->addAttr(llvm::Attribute::NoCapture);
+    out->addAttr(llvm::Attribute::NoAlias);
+    out->addAttr(llvm::Attribute::NoCapture);
+
+    // The entry block has the allocations and loads the column pointers,
+    // then skips the loop if there are no rows
+    llvm::BasicBlock* entry = llvm::BasicBlock::Create(context, "entry", func);
+    llvm::BasicBlock* loop = llvm::BasicBlock::Create(context, "loop", func);
+    llvm::BasicBlock* exit = llvm::BasicBlock::Create(context, "exit", func);
+
+    ctx.Builder->SetInsertPoint(entry);
+    llvm::Value* empty = ctx.Builder->CreateICmpEQ(n,
+        llvm::ConstantInt::get(sizeType, 0), "empty");
+    ctx.Builder->CreateCondBr(empty, exit, loop);
+
+    ctx.Builder->SetInsertPoint(exit);
+    ctx.Builder->CreateRetVoid();
+
+    // The program goes inside the loop, evaluated for row i
+    ctx.Builder->SetInsertPoint(loop);
+    ctx.KernelIndex = ctx.Builder->CreatePHI(sizeType, 2, "i");
+    ctx.KernelIndex->addIncoming(llvm::ConstantInt::get(sizeType, 0), entry);
+
+    return func;
+}
+
+llvm::Value* loadColumn(CompilerContext& ctx, llvm::StringRef name)
+{
+    auto it = ctx.ColumnValues.find(name.str());
+
+    // We can reuse the load from the first time since there's only one
+    // block in the loop
+    if (it != ctx.ColumnValues.end())
+        return it->second;
+
+    llvm::Function* func = ctx.KernelIndex->getFunction();
+    llvm::Type* elementType = storageType(ctx);
+    llvm::Type* columnType = llvm::PointerType::get(elementType, 0);
+
+    // Get the pointer to the column once, before the loop
+    llvm::IRBuilder<> TmpBuilder(func->getEntryBlock().getTerminator());
+    llvm::Value* column = TmpBuilder.CreateLoad(columnType,
+        TmpBuilder.CreateConstInBoundsGEP1_64(columnType, func->getArg(0),
+            ctx.Columns.size()), name + ".column");
+
+    llvm::Value* value = convertNumber(ctx, ctx.Builder->CreateLoad(elementType,
+        ctx.Builder->CreateInBoundsGEP(elementType, column, ctx.KernelIndex),
+        name), numberType(ctx));
+
+    ctx.Columns.push_back(name.str());
+    ctx.ColumnValues[name.str()] = value;
+
+    return value;
+}
+
+llvm::Function* createKernelFunction(CompilerContext& ctx, llvm::Value* body,
+        llvm::Function* func)
+{
+    if (body)
+    {
+        llvm::Type* elementType = storageType(ctx);
+        llvm::Value* i = ctx.KernelIndex;
+        llvm::Value* n = func->getArg(2);
+
+        // out[i] = body, then go on to the next row
+        ctx.Builder->CreateStore(convertNumber(ctx, body, elementType),
+            ctx.Builder->CreateInBoundsGEP(elementType, func->getArg(1), i));
+
+        llvm::Value* next = ctx.Builder->CreateAdd(i,
+            llvm::ConstantInt::get(i->getType(), 1), "next", true, true);
+        llvm::Value* done = ctx.Builder->CreateICmpEQ(next, n, "done");
+
+        llvm::BasicBlock* loop = ctx.Builder->GetInsertBlock();
+        llvm::BasicBlock* exit = &func->back();
+        ctx.Builder->CreateCondBr(done, exit, loop);
+        ctx.KernelIndex->addIncoming(next, loop);
+
+        // Remember which input is which column
+        addNames(ctx, ColumnsMetadata, ctx.Columns);
+
+        if (!llvm::verifyFunction(*func, &llvm::errs()))
+            return func;
+    }
+
+    // Error reading body, remove function
+    func->eraseFromParent();
+    return nullptr;
+}
+
+llvm::Function* createFusedPrototype(CompilerContext& ctx)
+{
+    llvm::LLVMContext& context = *ctx.TheContext;
+    llvm::PointerType* arrayType = llvm::PointerType::get(storageType(ctx), 0);
+
+    // Make the function type: void(const double*, double*)
+    llvm::FunctionType* functionType = llvm::FunctionType::get(
+        llvm::Type::getVoidTy(context), { arrayType, arrayType }, false);
+    llvm::Function* func = llvm::Function::Create(
+        functionType, llvm::Function::ExternalLinkage, FusedName, ctx.TheModule.get());
+
+    llvm::Argument* in = func->getArg(0);
+    llvm::Argument* out = func->getArg(1);
+    in->setName("in");
+    out->setName("out");
+
+    // Like a kernel, writing the outputs can't change the inputs
+    in->addAttr(llvm::Attribute::NoAlias);
+    in->addAttr(llvm::Attribute::ReadOnly);
+    in->addAttr(llvm::Attribute::NoCapture);
+    out->addAttr(llvm::Attribute::NoAlias);
+    out->addAttr(llvm::Attribute::NoCapture);
+
+    llvm::BasicBlock* entry = llvm::BasicBlock::Create(context, "entry", func);
+    ctx.Builder->SetInsertPoint(entry);
+
+    return func;
+}
+
+llvm::Value* loadInput(CompilerContext& ctx, llvm::StringRef name)
+{
+    auto it = ctx.ColumnValues.find(name.str());
+
+    // There's only the one block, so the first load is there for all the
+    // programs after it
+    if (it != ctx.ColumnValues.end())
+        return it->second;
+
+    llvm::Function* func = ctx.Builder->GetInsertBlock()->getParent();
+    llvm::Type* elementType = storageType(ctx);
+
+    llvm::Value* value = convertNumber(ctx, ctx.Builder->CreateLoad(elementType,
+        ctx.Builder->CreateConstInBoundsGEP1_64(elementType, func->getArg(0),
+            ctx.Columns.size()), name), numberType(ctx));
+
+    ctx.Columns.push_back(name.str());
+    ctx.ColumnValues[name.str()] = value;
+
+    return value;
+}
+
+llvm::Function* createFusedFunction(CompilerContext& ctx,
+        const std::vector<llvm::Value*>& results,
+        const std::vector<std::string>& names, llvm::Function* func)
+{
+    bool compiled = !results.empty() && std::all_of(results.begin(),
+        results.end(), [](llvm::Value* value) { return value; });
+
+    if (compiled)
+    {
+        llvm::Type* elementType = storageType(ctx);
+
+        // out[k] = program k
+        for (std::size_t k = 0; k < results.size(); ++k)
+            ctx.Builder->CreateStore(convertNumber(ctx, results[k], elementType),
+                ctx.Builder->CreateConstInBoundsGEP1_64(elementType,
+                    func->getArg(1), k));
+
+        ctx.Builder->CreateRetVoid();
+
+        addNames(ctx, ColumnsMetadata, ctx.Columns);
+        addNames(ctx, OutputsMetadata, names);
+
+        if (!llvm::verifyFunction(*func, &llvm::errs()))
+            return func;
+    }
+
+    // Error reading body, remove function
+    func->eraseFromParent();
+    return nullptr;
+}
+
+std::vector<std::string> fusedOutputs(const llvm::Module& module)
+{
+    return getNames(module, OutputsMetadata);
+}
+
+// Session variables are prefixed so they can't clash with our functions, or
+// with anything else the JIT might link against, e.g. a variable named sin
+static const char* const GlobalPrefix = "var.";
+
+// The global for the variable in this module, either defining it or
+// declaring that it's defined by another module
+static llvm::GlobalVariable* getGlobal(CompilerContext& ctx,
+        llvm::StringRef name, bool define)
+{
+    std::string globalName = GlobalPrefix + name.str();
+    llvm::GlobalVariable* global = ctx.TheModule->getNamedGlobal(globalName);
+
+    if (global)
+        return global;
+
+    llvm::Type* type = storageType(ctx);
+
+    return new llvm::GlobalVariable(*ctx.TheModule, type, false,
+        llvm::GlobalValue::ExternalLinkage,
+        define ? llvm::Constant::getNullValue(type) : nullptr,
+        globalName);
+}
+
+llvm::Value* loadGlobal(CompilerContext& ctx, llvm::StringRef name)
+{
+    if (!ctx.Globals.count(name.str()))
+        return ErrorV(ctx, "Unknown variable name");
+
+    llvm::GlobalVariable* global = getGlobal(ctx, name, false);
+    return convertNumber(ctx, ctx.Builder->CreateLoad(global->getValueType(),
+        global, name), numberType(ctx));
+}
+
+void storeGlobal(CompilerContext& ctx, llvm::StringRef name,
+        llvm::Value* value)
+{
+    bool define = !ctx.Globals.count(name.str());
+
+    if (define)
+        ctx.NewGlobals.insert(name.str());
+
+    llvm::GlobalVariable* global = getGlobal(ctx, name, define);
+    ctx.Builder->CreateStore(convertNumber(ctx, value, global->getValueType()),
+        global);
+}
+
+void commitGlobals(CompilerContext& ctx)
+{
+    ctx.Globals.insert(ctx.NewGlobals.begin(), ctx.NewGlobals.end());
+    ctx.NewGlobals.clear();
+}
+
+std::vector<std::string> kernelColumns(const llvm::Module& module)
+{
+    return getNames(module, ColumnsMetadata);
+}
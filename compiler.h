@@ -0,0 +1,324 @@
+/*
+ * WwuLang Compiler
+ *
+ * Going from the AST to LLVM IR
+ *
+ * References:
+ *
+ * Example used to take AST to the LLVM IR
+ * http://llvm.org/docs/tutorial/LangImpl3.html
+ *
+ * Example used for mutable variable support
+ * http://llvm.org/docs/tutorial/LangImpl7.html
+ */
+
+#ifndef WWULANG_COMPILER_H
+#define WWULANG_COMPILER_H
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/NoFolder.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "ast.h"
+#include "flat_ast.h"
+#include "numeric.h"
+#include "profile.h"
+
+// Needed for code generation
+const std::string MainName = "main";
+const std::string KernelName = "kernel";
+const std::string FusedName = "fused";
+
+// Which IR builder we use depends on the optimization level:
+//
+// With constant folding (the default), when optimizing:
+//   llvm::IRBuilder<>
+// Without constant folding (more interesting IR output), at -O0:
+//   llvm::IRBuilder<llvm::NoFolder>
+//
+// so the compiler only uses what they have in common.
+typedef llvm::IRBuilderBase builder_type;
+
+// Everything we need to compile one program. Nothing is shared between
+// contexts, so we can have as many as we want, e.g. one per thread.
+//
+// The LLVM context is recreated along with the module so that when running
+// in the JIT both can be handed off together.
+struct CompilerContext
+{
+    explicit CompilerContext(unsigned int optLevel = 0);
+
+    // Start over with a new module so we don't have multiple entry points,
+    // old code, variables carrying over from the last compile, etc.
+    void reset();
+
+    std::unique_ptr<llvm::LLVMContext> TheContext;
+    std::unique_ptr<llvm::Module> TheModule;
+    std::map<std::string, llvm::AllocaInst*> NamedValues;
+
+    // Whether to skip the memory for variables and go straight to SSA form.
+    // The programs are straight-line code, so each variable's value is just
+    // whatever was last assigned to it, which is kept in CurrentValues
+    // rather than NamedValues. This carries over when reset.
+    bool SSA;
+    std::map<std::string, llvm::Value*> CurrentValues;
+
+    // Only one of these exists at a time and Builder points to it. They
+    // don't share a virtual destructor, so we have to keep them separate.
+    std::unique_ptr<llvm::IRBuilder<llvm::NoFolder>> NoFoldBuilder;
+    std::unique_ptr<llvm::IRBuilder<>> FoldBuilder;
+    builder_type* Builder;
+
+    // Whether chains of + and -, or * and /, are evaluated as balanced
+    // trees rather than left to right, so rather than each operation
+    // waiting for the one before it, there are only log2(n) levels of them
+    // and the CPU can do the operations on each level at the same time.
+    // This is pairwise summation, which is also more accurate, but the
+    // results can differ from evaluating left to right. Chains with / in
+    // them are only rebalanced with FastMath, see canRebalance(). This
+    // carries over when reset.
+    bool Rebalance;
+
+    // Whether to also let LLVM assume there are no NaNs, infinities, or
+    // signed zeros, use reciprocals, and fuse multiplies and adds. This
+    // carries over when reset.
+    bool FastMath;
+
+    // What type the arithmetic is done in, see client::numeric_kind. With
+    // numeric_kind::auto_ each program's is picked by inferNumericKind(),
+    // and Arithmetic is set to it before compiling; until then it's f64.
+    // Numeric carries over when reset.
+    //
+    // main still takes and returns doubles whatever the type is, so it's
+    // called the same way, and the arguments and result are converted. A
+    // kernel's columns and output, and a session's variables, are stored
+    // as the Numeric type, which is double for auto.
+    client::numeric_kind Numeric;
+    client::numeric_kind Arithmetic;
+
+    // See optimizeModule() for what each level does
+    unsigned int OptLevel;
+
+    // When optimizing, the CPU we're running on, so the optimizations know
+    // what instructions it has. Modules are created for this target.
+    std::unique_ptr<llvm::TargetMachine> Target;
+
+    // Whether to compile a kernel rather than main, see
+    // createKernelPrototype(). This carries over when reset.
+    bool Kernel;
+
+    // Whether to compile many programs into one function rather than main,
+    // see createFusedPrototype(). This carries over when reset.
+    bool Fused;
+
+    // For a kernel or fused function: the names of the inputs in the order
+    // of the columns, the value of each (for the current row), and for a
+    // kernel, the row number
+    std::vector<std::string> Columns;
+    std::map<std::string, llvm::Value*> ColumnValues;
+    llvm::PHINode* KernelIndex;
+
+    // For main with parameters: where its code records the values it's
+    // called with, if anywhere, and the values to compile it for instead
+    // of its arguments, see createMainPrototype(). These carry over when
+    // reset.
+    client::value_profile* Profile;
+    std::map<std::string, double> Specialized;
+
+    // Whether variables carry over from one program to the next, e.g. from
+    // one line of the REPL to the next. Each variable is then also stored
+    // in a global, which later programs load it from. This and the
+    // variables carry over when reset.
+    bool Session;
+    std::set<std::string> Globals;
+
+    // The variables this program defines the globals for, since it's the
+    // first to assign them. These only become part of Globals when
+    // commitGlobals() is called, once the program has compiled (and run).
+    std::set<std::string> NewGlobals;
+
+    // Why the code couldn't be generated, set by ErrorV(). It's kept here
+    // rather than output straight away so that whoever is compiling can
+    // report it, e.g. in order with the other programs in a batch compiled
+    // on other threads. Only the first error is kept, and it's cleared when
+    // reset.
+    std::string Error;
+};
+
+// Record an error and return null rather than a valid LLVM Value pointer
+llvm::Value* ErrorV(CompilerContext& ctx, const char *s);
+
+// We need to create the prototype and the entry point before compiling the
+// code since during an assignment it adds allocations to this entry point.
+//
+// Each of the parameters becomes a double argument of main, which the
+// program can use like any other variable, after converting it to the type
+// the arithmetic is done in.
+//
+// If there's a profile, main records its arguments in it first. Any
+// parameter that's specialized is the constant instead of its argument,
+// which is then unused, so it's only right to call this main with that
+// value, see createGuard().
+llvm::Function* createMainPrototype(CompilerContext& ctx,
+        const std::vector<std::string>& params = std::vector<std::string>());
+
+// Take some code, e.g. assignment, and wrap it in a main function so that
+// it'll actually be able to do something
+llvm::Function* createMainFunction(CompilerContext& ctx, llvm::Value* body,
+        llvm::Function* func = nullptr);
+
+// For main compiled for the specialized values, create a function called
+// name, taking the same arguments, that checks they're those values and
+// calls main if so, and otherwise the generic version, which is a function
+// called generic elsewhere, e.g. already in the JIT. The values are
+// compared exactly, so e.g. -0 isn't 0. main is made internal, so it can be
+// inlined into the guard, leaving one function to optimize.
+llvm::Function* createGuard(CompilerContext& ctx, llvm::Function* main,
+        const std::string& name, const std::string& generic,
+        const std::vector<std::string>& params);
+
+// Rather than a main function evaluating the program once, create
+//
+//   void kernel(const double** in, double* out, size_t n)
+//
+// that evaluates it for each of the n rows, i.e. out[i] = program for each
+// i < n. Any variable the program uses without assigning it first is an
+// input: in[c][i] is its value for row i, where c is its column. The code
+// for the program goes inside the loop, which is simple enough for LLVM to
+// vectorize. The output mustn't overlap any of the inputs. When the
+// numbers are numeric_kind::f32 the columns and output are floats instead,
+// so twice as many rows fit in each vector, and for i64 they're int64_t.
+llvm::Function* createKernelPrototype(CompilerContext& ctx);
+
+// Store the body's value for the current row and finish off the loop
+llvm::Function* createKernelFunction(CompilerContext& ctx, llvm::Value* body,
+        llvm::Function* func);
+
+// The value of an input variable for the current row, giving it the next
+// column if it's the first time we've seen it
+llvm::Value* loadColumn(CompilerContext& ctx, llvm::StringRef name);
+
+// For a session: the value of a variable from an earlier program, or null
+// (after outputting an error) if no program has assigned it
+llvm::Value* loadGlobal(CompilerContext& ctx, llvm::StringRef name);
+
+// For a session: save the value of a variable that was just assigned so that
+// later programs can use it. The first program to assign a variable defines
+// its global and the others only declare it, so in the JIT they all end up
+// sharing the one definition.
+void storeGlobal(CompilerContext& ctx, llvm::StringRef name,
+        llvm::Value* value);
+
+// For a session: the program compiled, so later ones can use the variables
+// it assigned
+void commitGlobals(CompilerContext& ctx);
+
+// Rather than main, create
+//
+//   void fused(const double* in, double* out)
+//
+// for many programs at once, e.g. formulas from fuseAST(). out[k] is the
+// value of program k, and any variable used without being assigned is an
+// input: in[c] is its value, where c is its column. The inputs are only
+// loaded once, and anything the programs have in common computed once. The
+// output mustn't overlap the inputs. As for a kernel, the type is float or
+// int64_t rather than double if that's what the numbers are.
+llvm::Function* createFusedPrototype(CompilerContext& ctx);
+
+// Store the value of each program in the output and finish off the
+// function. The names of the outputs are saved along with the inputs.
+llvm::Function* createFusedFunction(CompilerContext& ctx,
+        const std::vector<llvm::Value*>& results,
+        const std::vector<std::string>& names, llvm::Function* func);
+
+// The value of an input of a fused function, giving it the next column if
+// it's the first time we've seen it
+llvm::Value* loadInput(CompilerContext& ctx, llvm::StringRef name);
+
+// The names of a compiled fused function's outputs in order, or empty if
+// it isn't one
+std::vector<std::string> fusedOutputs(const llvm::Module& module);
+
+// The names of a compiled kernel's or fused function's inputs by column.
+// They're saved in the module so this works for modules loaded from the
+// cache, too.
+std::vector<std::string> kernelColumns(const llvm::Module& module);
+
+namespace client { namespace ast {
+    // Go from AST to LLVM IR, putting the code into the context's module
+    struct compiler
+    {
+        typedef llvm::Value* result_type;
+
+        explicit compiler(CompilerContext& ctx) : ctx(ctx) { }
+
+        // When we get nothing, do nothing
+        llvm::Value* operator()(nil) const { return nullptr; }
+
+        llvm::Value* operator()(float n) const;
+        llvm::Value* operator()(const std::string& s) const;
+        llvm::Value* operator()(const operation& x, llvm::Value* lhs) const;
+        llvm::Value* operator()(const expression& x) const;
+        llvm::Value* operator()(const assignment& x) const;
+        llvm::Value* operator()(const program& x) const;
+
+        CompilerContext& ctx;
+    };
+}}
+
+namespace client { namespace flat {
+    // Go from the compact AST to LLVM IR, generating exactly the same code
+    // as ast::compiler does
+    struct compiler
+    {
+        explicit compiler(CompilerContext& ctx) : ctx(ctx) { }
+
+        // Returns whatever was the last value
+        llvm::Value* operator()(const program& x);
+
+        // Each node is only compiled once, even if it's used more than once
+        // as in an optimized program, see optimizeAST(). This doesn't
+        // recurse, so the program can be as deeply nested as memory allows.
+        llvm::Value* operator()(const program& x, index n);
+
+        CompilerContext& ctx;
+
+        // The variables by symbol rather than by name, since the symbol
+        // numbers are small. Which is used depends on ctx.SSA.
+        std::vector<llvm::AllocaInst*> values;
+        std::vector<llvm::Value*> ssaValues;
+
+        // What each node compiled to, if it has been yet, and what each
+        // line did, e.g. each program's value in a fused program
+        std::vector<llvm::Value*> nodeValues;
+        std::vector<llvm::Value*> lineValues;
+
+        // When rebalancing, how many times each node is used. A chain is
+        // only rebalanced through nodes that are only used by it, or the
+        // others would be computed twice.
+        std::vector<std::uint32_t> uses;
+
+    private:
+        // Find what the node needs compiled first, i.e. both sides of an
+        // operator, or all the terms of a chain when rebalancing
+        void operands(const program& x, index n);
+
+        // Compile the node once everything it needs has been
+        llvm::Value* compile(const program& x, index n);
+
+        // The nodes still to compile, and the operands of the current one,
+        // with whether each is subtracted or divided by
+        std::vector<index> pending;
+        std::vector<std::pair<index, bool>> parts;
+    };
+}}
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * WwuLang Compiler
+ *
+ * Writing compiled programs to files ahead of time
+ */
+
+#include "emit.h"
+#include "archive.h"
+
+#include <iostream>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/ToolOutputFile.h>
+
+namespace client
+{
+    emit_kind emitKind(const std::string& name)
+    {
+        if (name == "obj") return emit_kind::obj;
+        if (name == "asm") return emit_kind::asm_;
+        if (name == "bc")  return emit_kind::bc;
+        if (name == "ll")  return emit_kind::ll;
+        if (name == "so")  return emit_kind::so;
+        if (name == "archive") return emit_kind::archive;
+        return emit_kind::none;
+    }
+
+    const char* emitExtension(emit_kind kind)
+    {
+        switch (kind)
+        {
+            case emit_kind::obj:  return ".o";
+            case emit_kind::asm_: return ".s";
+            case emit_kind::bc:   return ".bc";
+            case emit_kind::ll:   return ".ll";
+            case emit_kind::so:   return ".so";
+            case emit_kind::archive: return ".wwla";
+            default:              return "";
+        }
+    }
+
+    // Generate machine code for the module, as an object file or assembly
+    static bool emitCode(llvm::Module& module, llvm::TargetMachine& target,
+        llvm::CodeGenFileType type, llvm::raw_pwrite_stream& out)
+    {
+        llvm::legacy::PassManager passes;
+
+        if (target.addPassesToEmitFile(passes, out, nullptr, type))
+        {
+            std::cerr << "Error: the target can't emit this kind of file"
+                << std::endl;
+            return false;
+        }
+
+        passes.run(module);
+        return true;
+    }
+
+    // Link the object file into a shared library with the C compiler, which
+    // knows where everything it needs is on this system
+    static bool linkShared(const std::string& object, const std::string& filename)
+    {
+        llvm::ErrorOr<std::string> cc = llvm::sys::findProgramByName("cc");
+
+        if (!cc)
+        {
+            std::cerr << "Error: could not find cc to link " << filename
+                << std::endl;
+            return false;
+        }
+
+        llvm::StringRef args[] = { *cc, "-shared", "-o", filename, object };
+        std::string error;
+
+        if (llvm::sys::ExecuteAndWait(*cc, args, llvm::None, {}, 0, 0,
+                &error) != 0)
+        {
+            std::cerr << "Error: could not link " << filename
+                << (error.empty() ? "" : ": " + error) << std::endl;
+            llvm::sys::fs::remove(filename);
+            return false;
+        }
+
+        return true;
+    }
+
+    // Open the file to write, or stdout for "-". Returns null after
+    // outputting an error if it can't be opened.
+    static std::unique_ptr<llvm::ToolOutputFile> openOutput(
+        const std::string& filename, bool text)
+    {
+        std::error_code ec;
+        std::unique_ptr<llvm::ToolOutputFile> out(new llvm::ToolOutputFile(
+            filename, ec, text ? llvm::sys::fs::OF_Text :
+                llvm::sys::fs::OF_None));
+
+        if (ec)
+        {
+            std::cerr << "Error: could not open " << filename << ": "
+                << ec.message() << std::endl;
+            return nullptr;
+        }
+
+        return out;
+    }
+
+    // Flush what's left of the output and check it was all written
+    static bool closeOutput(llvm::ToolOutputFile& out,
+        const std::string& filename)
+    {
+        out.os().close();
+
+        if (out.os().has_error())
+        {
+            std::cerr << "Error: could not write " << filename << ": "
+                << out.os().error().message() << std::endl;
+            out.os().clear_error();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool emitModule(llvm::Module& module, llvm::TargetMachine& target,
+        emit_kind kind, const std::string& filename)
+    {
+        if (kind == emit_kind::so && filename == "-")
+        {
+            std::cerr << "Error: a shared library can't be written to stdout"
+                << std::endl;
+            return false;
+        }
+
+        module.setTargetTriple(target.getTargetTriple().str());
+        module.setDataLayout(target.createDataLayout());
+
+        // A shared library goes through a temporary object file first
+        std::string output = filename;
+        llvm::SmallString<128> object;
+
+        if (kind == emit_kind::so)
+        {
+            if (std::error_code ec = llvm::sys::fs::createTemporaryFile(
+                    "wwulang", "o", object))
+            {
+                std::cerr << "Error: could not create a temporary file: "
+                    << ec.message() << std::endl;
+                return false;
+            }
+
+            output = object.str().str();
+        }
+
+        bool text = kind == emit_kind::asm_ || kind == emit_kind::ll;
+        std::unique_ptr<llvm::ToolOutputFile> file = openOutput(output, text);
+
+        if (!file)
+            return false;
+
+        llvm::ToolOutputFile& out = *file;
+
+        switch (kind)
+        {
+            case emit_kind::ll:
+                module.print(out.os(), nullptr);
+                break;
+
+            case emit_kind::bc:
+                llvm::WriteBitcodeToFile(module, out.os());
+                break;
+
+            case emit_kind::archive:
+                archive_writer(out.os()).add(module);
+                break;
+
+            case emit_kind::asm_:
+                if (!emitCode(module, target, llvm::CGFT_AssemblyFile, out.os()))
+                    return false;
+                break;
+
+            case emit_kind::obj:
+            case emit_kind::so:
+                if (!emitCode(module, target, llvm::CGFT_ObjectFile, out.os()))
+                    return false;
+                break;
+
+            default:
+                return false;
+        }
+
+        if (!closeOutput(out, output))
+            return false;
+
+        if (kind != emit_kind::so)
+        {
+            out.keep();
+            return true;
+        }
+
+        // Otherwise the temporary object is deleted once it's linked
+        return linkShared(output, filename);
+    }
+
+    archive_output::archive_output(const std::string& filename,
+        std::unique_ptr<llvm::ToolOutputFile> file)
+        : filename(filename), file(std::move(file)), writer(this->file->os())
+    {
+    }
+
+    std::unique_ptr<archive_output> archive_output::open(
+        const std::string& filename)
+    {
+        std::unique_ptr<llvm::ToolOutputFile> file = openOutput(filename,
+            false);
+
+        if (!file)
+            return nullptr;
+
+        return std::unique_ptr<archive_output>(
+            new archive_output(filename, std::move(file)));
+    }
+
+    void archive_output::add(llvm::StringRef name, llvm::StringRef bitcode)
+    {
+        writer.add(name, bitcode);
+    }
+
+    bool archive_output::finish()
+    {
+        if (!closeOutput(*file, filename))
+            return false;
+
+        file->keep();
+        return true;
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ * WwuLang Compiler
+ *
+ * Writing compiled programs to files ahead of time rather than running them
+ * in the JIT, e.g. to ship a shared library of precompiled programs
+ */
+
+#ifndef WWULANG_EMIT_H
+#define WWULANG_EMIT_H
+
+#include <memory>
+#include <string>
+
+#include <llvm/IR/Module.h>
+#include <llvm/Support/ToolOutputFile.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "archive.h"
+
+namespace client
+{
+    // What to write, like the compiler options of the same names. An
+    // archive is bitcode for each program on its own, see archive_writer.
+    enum class emit_kind { none, obj, asm_, bc, ll, so, archive };
+
+    // Get the kind from what --emit= is given, e.g. "obj". Returns
+    // emit_kind::none if it isn't one of them.
+    emit_kind emitKind(const std::string& name);
+
+    // The file extension for the kind, e.g. ".o", to name the output after
+    // the input if no name is given
+    const char* emitExtension(emit_kind kind);
+
+    // Write the module to the file. Object files, assembly, and shared
+    // libraries are generated for the target, and the module is set to use
+    // it first. A shared library is linked from an object file by the
+    // system's C compiler. Returns false (after outputting an error) if
+    // anything failed, in which case the file isn't created. The output is
+    // buffered, and goes to stdout if the filename is "-", other than for a
+    // shared library.
+    bool emitModule(llvm::Module& module, llvm::TargetMachine& target,
+        emit_kind kind, const std::string& filename);
+
+    // Write programs that are already bitcode to an archive, e.g. from the
+    // threads of a batch, without having to load them again. Each one is
+    // written as it's added, so it needn't be kept until the others are
+    // done. Like emitModule(), the file is only created if finish() is
+    // called and everything was written, though anything already written
+    // to stdout stays written.
+    class archive_output
+    {
+    public:
+        // Returns null (after outputting an error) if the file can't be
+        // opened
+        static std::unique_ptr<archive_output> open(
+            const std::string& filename);
+
+        void add(llvm::StringRef name, llvm::StringRef bitcode);
+
+        // Returns false (after outputting an error) if it couldn't all be
+        // written
+        bool finish();
+
+    private:
+        archive_output(const std::string& filename,
+            std::unique_ptr<llvm::ToolOutputFile> file);
+
+        std::string filename;
+        std::unique_ptr<llvm::ToolOutputFile> file;
+        archive_writer writer;
+    };
+}
+
+#endif
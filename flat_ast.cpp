@@ -0,0 +1,97 @@
+/*
+ * WwuLang Compiler
+ *
+ * A compact alternative to the AST in ast.h
+ */
+
+#include "flat_ast.h"
+
+namespace client { namespace flat {
+    symbol symbol_table::intern(llvm::StringRef name)
+    {
+        // Only adds it if it isn't there already
+        auto result = symbols.insert(std::make_pair(name,
+            static_cast<symbol>(names.size())));
+
+        if (result.second)
+            names.push_back(result.first->getKey());
+
+        return result.first->getValue();
+    }
+
+    void printer::operator()(const program& x) const
+    {
+        for (const line& l : x.lines)
+        {
+            (*this)(x, l.root);
+
+            // For an assignment, output that the result will be read into
+            // this variable
+            if (l.variable != no_symbol)
+            {
+                llvm::StringRef name = x.symbols.name(l.variable);
+                out << " =";
+                out.write(name.data(), name.size());
+                out << " ";
+            }
+        }
+    }
+
+    void printer::operator()(const program& x, index n) const
+    {
+        // What's left to output: a node, or the space or operator after an
+        // operation's left or right side. There's no limit on how deep the
+        // AST is, so we keep these ourselves instead of recursing.
+        enum step { visit, space, operator_ };
+        std::vector<std::pair<index, step>> pending{ { n, visit } };
+
+        while (!pending.empty())
+        {
+            index i = pending.back().first;
+            step s = pending.back().second;
+            const node& current = x.nodes[i];
+            pending.pop_back();
+
+            if (s == space)
+            {
+                out << " ";
+                continue;
+            }
+
+            if (s == operator_)
+            {
+                switch (current.operator_)
+                {
+                    case '+': out << " +"; break;
+                    case '-': out << " -"; break;
+                    case '*': out << " *"; break;
+                    case '/': out << " /"; break;
+                    default:  out << " ?"; break;
+                }
+                continue;
+            }
+
+            switch (current.kind)
+            {
+                case node::number:
+                    out << current.value;
+                    break;
+
+                case node::variable:
+                {
+                    llvm::StringRef name = x.symbols.name(current.name);
+                    out.write(name.data(), name.size());
+                    break;
+                }
+
+                case node::operation:
+                    // Backwards, so the left-hand side comes out first
+                    pending.emplace_back(i, operator_);
+                    pending.emplace_back(current.rhs, visit);
+                    pending.emplace_back(i, space);
+                    pending.emplace_back(current.lhs, visit);
+                    break;
+            }
+        }
+    }
+}}
@@ -0,0 +1,112 @@
+/*
+ * WwuLang Compiler
+ *
+ * A compact alternative to the AST in ast.h. Rather than each part being
+ * allocated separately, all the nodes of a program are in one array and
+ * refer to each other by index, and variable names are stored once in a
+ * symbol table and referred to by number.
+ */
+
+#ifndef WWULANG_FLAT_AST_H
+#define WWULANG_FLAT_AST_H
+
+#include <vector>
+#include <cstdint>
+#include <iostream>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+
+namespace client { namespace flat {
+    // Which node in the program's array
+    typedef std::uint32_t index;
+
+    // Which name in the symbol table
+    typedef std::uint32_t symbol;
+
+    // An expression line rather than an assignment doesn't have a variable
+    const symbol no_symbol = UINT32_MAX;
+
+    // Each node is either a number, a variable, or an operator (e.g. +)
+    // applied to two other nodes. An expression like "1 + 2 - 3" is stored
+    // as "(1 + 2) - 3" since that's the order we evaluate it in.
+    struct node
+    {
+        enum kind_type : std::uint8_t { number, variable, operation };
+
+        kind_type kind;
+        char operator_;
+
+        union
+        {
+            float value;
+            symbol name;
+            index lhs;
+        };
+
+        index rhs;
+    };
+
+    // Give each distinct variable name a number. This is meant to be kept
+    // for many programs, so that each name is only stored once.
+    class symbol_table
+    {
+    public:
+        symbol intern(llvm::StringRef name);
+
+        llvm::StringRef name(symbol s) const { return names[s]; }
+        std::size_t size() const { return names.size(); }
+
+    private:
+        llvm::StringMap<symbol> symbols;
+
+        // Point to the keys stored in the map, which never move
+        std::vector<llvm::StringRef> names;
+    };
+
+    // Either "variable = root" or just "root" if variable is no_symbol
+    struct line
+    {
+        symbol variable;
+        index root;
+    };
+
+    // A program can consist of multiple lines
+    struct program
+    {
+        explicit program(symbol_table& symbols) : symbols(symbols) { }
+
+        // Start over for the next program, keeping the memory we've already
+        // allocated. Nothing needs to be destructed, so this is O(1).
+        void clear()
+        {
+            nodes.clear();
+            lines.clear();
+        }
+
+        index add(const node& n)
+        {
+            nodes.push_back(n);
+            return static_cast<index>(nodes.size() - 1);
+        }
+
+        // All the nodes for all the lines
+        std::vector<node> nodes;
+        std::vector<line> lines;
+        symbol_table& symbols;
+    };
+
+    // Output the AST visually, exactly like ast::printer does
+    struct printer
+    {
+        explicit printer(std::ostream& out = std::cout) : out(out) { }
+
+        void operator()(const program& x) const;
+        void operator()(const program& x, index n) const;
+
+        // Where to output to
+        std::ostream& out;
+    };
+}}
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * WwuLang Compiler
+ *
+ * The Spirit grammar for parsing source code into the AST
+ *
+ * References:
+ *
+ * Example used to figure out Spirit parsing and AST generation:
+ * http://boost.org/doc/libs/1_60_0/libs/spirit/example/qi/compiler_tutorial/calc4.cpp
+ */
+
+#ifndef WWULANG_GRAMMAR_H
+#define WWULANG_GRAMMAR_H
+
+// Allow easy debugging of parser (not working yet)
+// #define BOOST_SPIRIT_DEBUG
+
+// This will make it build faster (supposedly). We just have to specify
+// what type the elements of our grammar are.
+#define BOOST_SPIRIT_NO_PREDEFINED_TERMINALS
+
+#include <string>
+
+#include <boost/config/warning_disable.hpp>
+#include <boost/spirit/include/qi.hpp>
+#include <boost/spirit/include/qi_lit.hpp>
+#include <boost/spirit/include/qi_real.hpp>
+#include <boost/spirit/include/qi_char_class.hpp>
+#include <boost/spirit/include/phoenix_operator.hpp>
+
+#include "ast.h"
+
+namespace client
+{
+    // Allow accessing via shorter namespaces
+    namespace qi = boost::spirit::qi;
+    namespace ascii = boost::spirit::ascii;
+
+    // The grammar
+    template <typename Iterator>
+    struct calculator
+        : qi::grammar<
+            // For example, iterating over a std::string or std::vector<char>
+            Iterator,
+            // What we'll be parsing into, the result
+            ast::program(),
+            // What we're skipping. In this case we probably don't care about
+            // whitespace.
+            ascii::space_type
+        >
+    {
+        calculator() : calculator::base_type(program)
+        {
+            // This is because we did BOOST_SPIRIT_NO_PREDEFINED_TERMINALS
+            qi::float_type float_;
+            qi::char_type char_;
+            qi::lexeme_type lexeme_;
+            qi::alnum_type alnum_;
+            qi::lit_type lit_;
+
+            // Our BNF grammar
+            //
+            // A program consists of one or more line with a semicolon separating
+            program = (program_line % ';') >> -lit_(";");
+
+            // The program line is either an assignment or an expression
+            program_line = assignment | expression;
+
+            // Assignment
+            //
+            // We do lit_("=") rather than char_('=') since we don't actually
+            // want to store the equal sign in the AST like we do when doing
+            // operators like + or -. We only want to store the expression and
+            // what variable we want to save that expressions's result to.
+            assignment = variable >> lit_("=") >> expression;
+
+            // Handle order of operations, do the addition/subtraction last
+            expression = term >> *(char_('+') >> term | char_('-') >> term);
+
+            // Do the multiplication/division before add/subtract
+            term = factor >> *(char_('*') >> factor | char_('/') >> factor);
+
+            // Do what's inside parenthesis before mult/div
+            factor = '(' >> expression >> ')' | float_ | variable;
+
+            // Variables are alphanumeric
+            //
+            // We use a lexeme here to make sure it doesn't ignore spaces, i.e.
+            // we want to make sure the variable name is only alphanumeric, not
+            // alphanumeric separated by spaces
+            variable %= lexeme_[+alnum_];
+
+            // Debugging
+            BOOST_SPIRIT_DEBUG_NODE(program);
+            BOOST_SPIRIT_DEBUG_NODE(program_line);
+            BOOST_SPIRIT_DEBUG_NODE(assignment);
+            BOOST_SPIRIT_DEBUG_NODE(expression);
+            BOOST_SPIRIT_DEBUG_NODE(term);
+            BOOST_SPIRIT_DEBUG_NODE(factor);
+            BOOST_SPIRIT_DEBUG_NODE(variable);
+        }
+
+        // Specify the iterator, result, and skip types for each
+        //
+        // program is a program, program_line is either an assignment or an
+        // expression, and assignment is an assignment.
+        //
+        // expression and term result type is expression() because they have
+        // the Kleene star, having one term first with a variable number of
+        // operator followed by more terms aftewards.
+        //
+        // factor doesn't. It's either a subexpression or an integer, which
+        // corresponds with our boost::variant that can be one of several
+        // types.
+        //
+        // The last is just a variable name, which is a string. Actually, it's
+        // a vector of chars that can be cast to a string.
+        qi::rule<Iterator, ast::program(), ascii::space_type> program;
+        qi::rule<Iterator, ast::program_line(), ascii::space_type> program_line;
+        qi::rule<Iterator, ast::assignment(), ascii::space_type> assignment;
+        qi::rule<Iterator, ast::expression(), ascii::space_type> expression;
+        qi::rule<Iterator, ast::expression(), ascii::space_type> term;
+        qi::rule<Iterator, ast::operand(), ascii::space_type> factor;
+        qi::rule<Iterator, std::string(), ascii::space_type> variable;
+    };
+}
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * WwuLang Compiler
+ *
+ * Reading a source file too big to fit in memory one statement at a time
+ */
+
+#include "input.h"
+
+#include <cstring>
+#include <algorithm>
+
+#include <llvm/Support/Error.h>
+
+namespace client
+{
+    // How much of the file to map at once to begin with. Statements longer
+    // than this make it bigger.
+    static const std::uint64_t WindowSize = 16 * 1024 * 1024;
+
+    statement_reader::statement_reader()
+        : file(llvm::sys::fs::kInvalidFile), size(0), windowStart(0),
+          windowSize(WindowSize), position(0)
+    {
+    }
+
+    statement_reader::~statement_reader()
+    {
+        window.unmap();
+
+        if (file != llvm::sys::fs::kInvalidFile)
+            llvm::sys::fs::closeFile(file);
+    }
+
+    bool statement_reader::open(const std::string& filename, std::string& error)
+    {
+        llvm::Expected<llvm::sys::fs::file_t> opened =
+            llvm::sys::fs::openNativeFileForRead(filename);
+
+        if (!opened)
+        {
+            error = "could not open " + filename + ": " +
+                llvm::toString(opened.takeError());
+            return false;
+        }
+
+        file = *opened;
+
+        llvm::sys::fs::file_status status;
+
+        if (std::error_code ec = llvm::sys::fs::status(file, status))
+        {
+            error = "could not read " + filename + ": " + ec.message();
+            return false;
+        }
+
+        size = status.getSize();
+        return true;
+    }
+
+    bool statement_reader::next(llvm::StringRef& statement, std::string& error)
+    {
+        while (position < size)
+        {
+            if (!window || position < windowStart ||
+                position >= windowStart + window.size())
+            {
+                if (!map(position, error))
+                    return false;
+            }
+
+            const char* data = window.const_data();
+            const char* first = data + (position - windowStart);
+            const char* last = data + window.size();
+            const char* end = static_cast<const char*>(
+                std::memchr(first, ';', last - first));
+
+            // The statement goes past the end of the window, so move the
+            // window up to it, or if it's already there, make it bigger
+            if (!end && windowStart + window.size() < size)
+            {
+                if (first - data < llvm::sys::fs::mapped_file_region::alignment())
+                    windowSize *= 2;
+
+                if (!map(position, error))
+                    return false;
+
+                continue;
+            }
+
+            if (end)
+            {
+                position += end - first + 1;
+            }
+            else
+            {
+                end = last;
+                position = size;
+            }
+
+            // Blank, e.g. after the last ';'
+            if (std::all_of(first, end, [](char c)
+                    { return c == ' ' || (c >= '\t' && c <= '\r'); }))
+                continue;
+
+            statement = llvm::StringRef(first, end - first);
+            return true;
+        }
+
+        return false;
+    }
+
+    bool statement_reader::map(std::uint64_t position, std::string& error)
+    {
+        // Only the new window is in memory, not the old one too
+        window.unmap();
+
+        windowStart = position - position %
+            llvm::sys::fs::mapped_file_region::alignment();
+
+        std::error_code ec;
+        window = llvm::sys::fs::mapped_file_region(file,
+            llvm::sys::fs::mapped_file_region::readonly,
+            std::min(windowSize, size - windowStart), windowStart, ec);
+
+        if (ec)
+        {
+            error = "could not map the file: " + ec.message();
+            return false;
+        }
+
+        return true;
+    }
+}
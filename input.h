@@ -0,0 +1,58 @@
+/*
+ * WwuLang Compiler
+ *
+ * Reading a source file too big to fit in memory one statement at a time
+ */
+
+#ifndef WWULANG_INPUT_H
+#define WWULANG_INPUT_H
+
+#include <string>
+#include <cstdint>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/FileSystem.h>
+
+namespace client
+{
+    // Goes through the ';'-separated statements of a file by mapping part of
+    // it into memory at a time, so the statements aren't copied anywhere and
+    // how much memory we use depends on how long the statements are rather
+    // than how big the file is. The window is moved along the file as we go,
+    // and grows if a statement doesn't fit in it.
+    class statement_reader
+    {
+    public:
+        statement_reader();
+        ~statement_reader();
+
+        statement_reader(const statement_reader&) = delete;
+        statement_reader& operator=(const statement_reader&) = delete;
+
+        // Returns false with the reason in error if it can't be read
+        bool open(const std::string& filename, std::string& error);
+
+        // Get the next statement, without the ';', skipping any that are
+        // only whitespace. It points into the file, so it's only valid
+        // until the next call. Returns false at the end of the file, or if
+        // reading failed, in which case the reason is in error.
+        bool next(llvm::StringRef& statement, std::string& error);
+
+    private:
+        // Map the window so it starts at or just before position
+        bool map(std::uint64_t position, std::string& error);
+
+        llvm::sys::fs::file_t file;
+        std::uint64_t size;
+
+        // The part of the file that's mapped, and where it starts
+        llvm::sys::fs::mapped_file_region window;
+        std::uint64_t windowStart;
+        std::uint64_t windowSize;
+
+        // Where the next statement starts
+        std::uint64_t position;
+    };
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * WwuLang Compiler
+ *
+ * Running a program with a small interpreter
+ */
+
+#include "interpreter.h"
+
+#include <algorithm>
+
+namespace client
+{
+    // Programs with up to this many registers keep them on the stack
+    static const std::uint32_t StackRegisters = 64;
+
+    bool lowerBytecode(const flat::program& program,
+        const std::vector<std::string>& params, bytecode& out,
+        std::string& error)
+    {
+        out.params = static_cast<std::uint32_t>(params.size());
+        out.constants.clear();
+        out.code.clear();
+
+        if (program.lines.empty())
+        {
+            error = "nothing to run";
+            return false;
+        }
+
+        // The parameters by symbol, so variables can be looked up quickly
+        std::vector<std::uint32_t> paramRegisters;
+
+        for (std::size_t i = 0; i < params.size(); ++i)
+        {
+            flat::symbol s = program.symbols.intern(params[i]);
+
+            if (s >= paramRegisters.size())
+                paramRegisters.resize(s + 1, UINT32_MAX);
+
+            paramRegisters[s] = static_cast<std::uint32_t>(i);
+        }
+
+        // Numbers go after the parameters, so they're done first, and then
+        // the operators in order after them
+        std::vector<std::uint32_t> registers(program.nodes.size());
+
+        for (std::size_t i = 0; i < program.nodes.size(); ++i)
+        {
+            const flat::node& n = program.nodes[i];
+
+            if (n.kind == flat::node::number)
+            {
+                registers[i] = out.params +
+                    static_cast<std::uint32_t>(out.constants.size());
+                out.constants.push_back(n.value);
+            }
+        }
+
+        std::uint32_t next = out.params +
+            static_cast<std::uint32_t>(out.constants.size());
+
+        for (std::size_t i = 0; i < program.nodes.size(); ++i)
+        {
+            const flat::node& n = program.nodes[i];
+
+            switch (n.kind)
+            {
+                case flat::node::number:
+                    break;
+
+                case flat::node::variable:
+                    if (n.name >= paramRegisters.size() ||
+                        paramRegisters[n.name] == UINT32_MAX)
+                    {
+                        error = "Unknown variable name " +
+                            program.symbols.name(n.name).str();
+                        return false;
+                    }
+
+                    registers[i] = paramRegisters[n.name];
+                    break;
+
+                case flat::node::operation:
+                default:
+                {
+                    bytecode::instruction instruction;
+
+                    switch (n.operator_)
+                    {
+                        case '+': instruction.op = bytecode::add; break;
+                        case '-': instruction.op = bytecode::sub; break;
+                        case '*': instruction.op = bytecode::mul; break;
+                        case '/': instruction.op = bytecode::div; break;
+                        default:
+                            error = "invalid binary operator";
+                            return false;
+                    }
+
+                    instruction.dest = next;
+                    instruction.lhs = registers[n.lhs];
+                    instruction.rhs = registers[n.rhs];
+                    out.code.push_back(instruction);
+                    registers[i] = next++;
+                    break;
+                }
+            }
+        }
+
+        out.registers = next;
+        out.result = registers[program.lines.back().root];
+        return true;
+    }
+
+    double interpret(const bytecode& program, const double* args)
+    {
+        // Bigger programs use memory kept for the thread, so nothing is
+        // allocated after the first call
+        double stack[StackRegisters];
+        thread_local std::vector<double> heap;
+        double* r = stack;
+
+        if (program.registers > StackRegisters)
+        {
+            if (heap.size() < program.registers)
+                heap.resize(program.registers);
+
+            r = heap.data();
+        }
+
+        std::copy(args, args + program.params, r);
+        std::copy(program.constants.begin(), program.constants.end(),
+            r + program.params);
+
+        for (const bytecode::instruction& i : program.code)
+        {
+            switch (i.op)
+            {
+                case bytecode::add: r[i.dest] = r[i.lhs] + r[i.rhs]; break;
+                case bytecode::sub: r[i.dest] = r[i.lhs] - r[i.rhs]; break;
+                case bytecode::mul: r[i.dest] = r[i.lhs] * r[i.rhs]; break;
+                case bytecode::div: r[i.dest] = r[i.lhs] / r[i.rhs]; break;
+            }
+        }
+
+        return r[program.result];
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * WwuLang Compiler
+ *
+ * Running a program straight away with a small interpreter, for when it
+ * would take longer to compile it to native code than to run it the few
+ * times it's used
+ */
+
+#ifndef WWULANG_INTERPRETER_H
+#define WWULANG_INTERPRETER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "flat_ast.h"
+
+namespace client
+{
+    // A program as instructions for a register machine. Each register holds
+    // a double: the parameters come first, then the numbers in the program,
+    // then the result of each instruction in turn, so every register is
+    // only written once and nothing has to be allocated.
+    struct bytecode
+    {
+        enum opcode : std::uint8_t { add, sub, mul, div };
+
+        // registers[dest] = registers[lhs] op registers[rhs]
+        struct instruction
+        {
+            opcode op;
+            std::uint32_t dest;
+            std::uint32_t lhs;
+            std::uint32_t rhs;
+        };
+
+        std::uint32_t params = 0;
+        std::vector<double> constants;
+        std::vector<instruction> code;
+
+        // How many registers there are, and which one has the answer
+        std::uint32_t registers = 0;
+        std::uint32_t result = 0;
+    };
+
+    // Turn a program from optimizeAST() into bytecode. It has to be
+    // optimized, since that replaces variables with what was assigned to
+    // them, and puts each node after everything it uses, so there's one
+    // instruction per operator in order. Any variable left must be one of
+    // the parameters. Returns false with the reason in error if not.
+    bool lowerBytecode(const flat::program& program,
+        const std::vector<std::string>& params, bytecode& out,
+        std::string& error);
+
+    // Run the program with the parameters in args, giving exactly what the
+    // native code would. This can be called on any number of threads at
+    // once.
+    double interpret(const bytecode& program, const double* args);
+}
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * WwuLang Compiler
+ *
+ * Running the compiled code with LLVM's ORC JIT
+ */
+
+#include "jit.h"
+#include "optimizer.h"
+
+#include <mutex>
+#include <vector>
+#include <iostream>
+
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+
+namespace client
+{
+    namespace
+    {
+        // Compiles each module with a target machine of its own, like
+        // ConcurrentIRCompiler, so many threads can compile at once. Rather
+        // than creating one for every module, which takes longer than
+        // compiling most of our programs, they're kept for the next module.
+        class reusing_compiler : public llvm::orc::IRCompileLayer::IRCompiler
+        {
+        public:
+            explicit reusing_compiler(llvm::orc::JITTargetMachineBuilder builder)
+                : IRCompiler(llvm::orc::irManglingOptionsFromTargetOptions(
+                      builder.getOptions())),
+                  builder(std::move(builder))
+            {
+            }
+
+            llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(
+                llvm::Module& module) override
+            {
+                std::unique_ptr<llvm::TargetMachine> target;
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+
+                    if (!unused.empty())
+                    {
+                        target = std::move(unused.back());
+                        unused.pop_back();
+                    }
+                }
+
+                if (!target)
+                {
+                    llvm::Expected<std::unique_ptr<llvm::TargetMachine>>
+                        created = builder.createTargetMachine();
+
+                    if (!created)
+                        return created.takeError();
+
+                    target = std::move(*created);
+                }
+
+                llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> object =
+                    llvm::orc::SimpleCompiler(*target)(module);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                unused.push_back(std::move(target));
+                return object;
+            }
+
+        private:
+            llvm::orc::JITTargetMachineBuilder builder;
+
+            // Guards the target machines nobody is using at the moment
+            std::mutex mutex;
+            std::vector<std::unique_ptr<llvm::TargetMachine>> unused;
+        };
+    }
+
+    jit::jit(std::unique_ptr<llvm::orc::LLJIT> lljit)
+        : lljit(std::move(lljit))
+    {
+    }
+
+    std::unique_ptr<jit> jit::create(llvm::CodeGenOpt::Level level)
+    {
+        // We only generate code for the machine we're running on
+        initializeNativeTarget();
+
+        // By default all modules are compiled with the same target
+        // machine, which would make compiling on multiple threads at once
+        // unsafe, so each compile has one to itself instead
+        llvm::Expected<std::unique_ptr<llvm::orc::LLJIT>> lljit =
+            llvm::orc::LLJITBuilder()
+                .setCompileFunctionCreator(
+                    [level](llvm::orc::JITTargetMachineBuilder builder)
+                        -> llvm::Expected<std::unique_ptr<
+                            llvm::orc::IRCompileLayer::IRCompiler>>
+                    {
+                        builder.setCodeGenOptLevel(level);
+                        return std::make_unique<reusing_compiler>(
+                            std::move(builder));
+                    })
+                .create();
+
+        if (!lljit)
+        {
+            std::cerr << "Error: " << llvm::toString(lljit.takeError())
+                << std::endl;
+            return nullptr;
+        }
+
+        return std::unique_ptr<jit>(new jit(std::move(*lljit)));
+    }
+
+    const llvm::DataLayout& jit::getDataLayout() const
+    {
+        return lljit->getDataLayout();
+    }
+
+    llvm::orc::ResourceTrackerSP jit::add(std::unique_ptr<llvm::Module> module,
+        std::unique_ptr<llvm::LLVMContext> context)
+    {
+        // Track this module's code separately so we can throw it away when
+        // we're done with it
+        llvm::orc::ResourceTrackerSP tracker =
+            lljit->getMainJITDylib().createResourceTracker();
+
+        llvm::Error error = lljit->addIRModule(tracker,
+            llvm::orc::ThreadSafeModule(std::move(module), std::move(context)));
+
+        if (error)
+        {
+            std::cerr << "Error: " << llvm::toString(std::move(error))
+                << std::endl;
+            return nullptr;
+        }
+
+        return tracker;
+    }
+
+    llvm::JITTargetAddress jit::lookup(const std::string& name)
+    {
+        // This is where the code actually gets compiled
+        llvm::Expected<llvm::JITEvaluatedSymbol> symbol = lljit->lookup(name);
+
+        if (!symbol)
+        {
+            std::cerr << "Error: " << llvm::toString(symbol.takeError())
+                << std::endl;
+            return 0;
+        }
+
+        return symbol->getAddress();
+    }
+
+    bool jit::run(std::unique_ptr<llvm::Module> module,
+        std::unique_ptr<llvm::LLVMContext> context,
+        const std::string& name, double& result, bool keep)
+    {
+        llvm::orc::ResourceTrackerSP tracker = add(std::move(module),
+            std::move(context));
+
+        if (!tracker)
+            return false;
+
+        llvm::JITTargetAddress address = lookup(name);
+
+        if (!address)
+        {
+            llvm::consumeError(tracker->remove());
+            return false;
+        }
+
+        // Call it as the double() function we created
+        double (*func)() = reinterpret_cast<double (*)()>(
+            static_cast<intptr_t>(address));
+        result = func();
+
+        if (keep)
+            return true;
+
+        // Remove it so the next line can reuse the same name
+        if (llvm::Error removeError = tracker->remove())
+        {
+            std::cerr << "Error: " << llvm::toString(std::move(removeError))
+                << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ * WwuLang Compiler
+ *
+ * Running the compiled code with LLVM's ORC JIT
+ *
+ * References:
+ *
+ * Example used to set up the JIT
+ * http://llvm.org/docs/tutorial/BuildingAJIT1.html
+ */
+
+#ifndef WWULANG_JIT_H
+#define WWULANG_JIT_H
+
+#include <memory>
+#include <string>
+
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+
+namespace client
+{
+    // One JIT session that is created once and then reused for every line
+    // we compile, so we only pay for setting up the target, the object
+    // layers, etc. a single time.
+    class jit
+    {
+    public:
+        // Returns null (after outputting an error) if we couldn't create
+        // a JIT for this machine. The level is how hard the code generator
+        // tries, separately from the optimizations on the IR, so code that
+        // only runs once can be generated quicker.
+        static std::unique_ptr<jit> create(
+            llvm::CodeGenOpt::Level level = llvm::CodeGenOpt::Default);
+
+        // Modules should use this so the JIT doesn't have to fix them up
+        const llvm::DataLayout& getDataLayout() const;
+
+        // Compile the module to native code, call the double() function
+        // with the given name, and put what it returned into result. The
+        // code is removed from the session afterwards so that the next
+        // module can define a function with the same name, unless keep is
+        // set, e.g. so later modules can use the globals it defines.
+        //
+        // Returns false (after outputting an error) if this failed.
+        bool run(std::unique_ptr<llvm::Module> module,
+            std::unique_ptr<llvm::LLVMContext> context,
+            const std::string& name, double& result, bool keep = false);
+
+        // Add the module to the session, where it stays until the returned
+        // tracker is removed. Its functions are compiled the first time
+        // they're looked up. Returns null (after outputting an error) if
+        // this failed.
+        //
+        // Both this and lookup() can be used from multiple threads at once.
+        llvm::orc::ResourceTrackerSP add(std::unique_ptr<llvm::Module> module,
+            std::unique_ptr<llvm::LLVMContext> context);
+
+        // The address of the compiled function, or 0 (after outputting an
+        // error) if it isn't there or failed to compile
+        llvm::JITTargetAddress lookup(const std::string& name);
+
+    private:
+        explicit jit(std::unique_ptr<llvm::orc::LLJIT> lljit);
+
+        std::unique_ptr<llvm::orc::LLJIT> lljit;
+    };
+}
+
+#endif
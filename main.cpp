@@ -16,524 +16,1420 @@
  * http://llvm.org/docs/tutorial/LangImpl7.html
  */
 
-// Allow easy debugging of parser (not working yet)
-// #define BOOST_SPIRIT_DEBUG
-
-// This will make it build faster (supposedly). We just have to specify
-// what type the elements of our grammar are.
-#define BOOST_SPIRIT_NO_PREDEFINED_TERMINALS
-
-#include <map>
-#include <cctype>
-#include <cstdio>
-#include <cassert>
+#include <atomic>
+#include <mutex>
+#include <cstdlib>
 #include <string>
+#include <thread>
 #include <vector>
+#include <fstream>
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <new>
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+// Parsing and constructing the AST
+#include "ast.h"
+#include "grammar.h"
+#include "parser.h"
 
 // For going from AST to LLVM IR
-#include <llvm/ADT/STLExtras.h>
-#include <llvm/IR/IRBuilder.h>
-#include <llvm/IR/LLVMContext.h>
-#include <llvm/IR/Module.h>
-#include <llvm/IR/Verifier.h>
-#include <llvm/IR/NoFolder.h>
-
-// Boost libraries for parsing and constructing the AST
-#include <boost/config/warning_disable.hpp>
-#include <boost/spirit/include/qi.hpp>
-#include <boost/spirit/include/qi_lit.hpp>
-#include <boost/spirit/include/qi_real.hpp>
-#include <boost/spirit/include/qi_char_class.hpp>
-#include <boost/spirit/include/phoenix_operator.hpp>
-#include <boost/variant/recursive_variant.hpp>
-#include <boost/variant/apply_visitor.hpp>
-#include <boost/fusion/include/adapt_struct.hpp>
-
-// The Abstract Syntax Tree (AST)
-namespace client { namespace ast {
-    // This part may be nothing
-    struct nil {};
-
-    // This part may be an entire expression. The forward declaration since we
-    // have cyclic references (operand may be an expression, but an expression
-    // consists of operands).
-    struct expression;
-
-    // Each part of the tree may be any one of these types.
-    //
-    // Note: we'll postfix a name with an underscore when the name is
-    // reserved or we're declaring an instance of a class with the same
-    // name.
-    typedef boost::variant<
-        float,
-        std::string,
-        boost::recursive_wrapper<expression>
-    > operand;
-
-    // This part may consist of some operator (e.g. +) and then some other part
-    // of the expression, which may consist of another number (using the
-    // float variant), nothing if this is the end (using nil), etc.
-    struct operation
-    {
-        char operator_;
-        operand operand_;
-    };
+#include "compiler.h"
 
-    // The topmost part will be an "expression", which consists of one or more
-    // things (nothing, numbers, or other expressions)
-    struct expression
-    {
-        operand first;
-        // Note: this means we'll be using the Kleene star as these in the
-        // AST have to correspond directly with how we describe what we
-        // can parse
-        std::vector<operation> rest;
-    };
+// Optimizing the LLVM IR
+#include "optimizer.h"
 
-    // Define a variable to take on the value of an expression
-    struct assignment
-    {
-        std::string variable;
-        expression expression_;
-    };
+// Running the compiled code
+#include "jit.h"
+
+// Not compiling the same thing twice
+#include "cache.h"
+
+// Optimizing before LLVM sees it
+#include "ast_optimizer.h"
+
+// Doing the arithmetic on floats or integers
+#include "numeric.h"
+
+// Measuring how long everything takes
+#include "stats.h"
+
+// Reading files too big for memory
+#include "input.h"
+
+// Writing object files, shared libraries, etc.
+#include "emit.h"
+
+// Compiling for other processes
+#include "server.h"
 
-    // A program line can either be an assignment or an expression
-    //
-    // Note: we no longer have nothing since the program is a vector, so the
-    // "nothing" program can be represented by a program vector of length zero.
-    typedef boost::variant<
-        /*nil,*/
-        assignment,
-        expression
-    > program_line;
-
-    // A program can consist of multiple lines
-    typedef std::vector<program_line> program;
-}}
-
-// Makes this AST struct a "first-class fusion citizen that the grammar can
-// utilize." I.e., this is important. For some reason. Don't know why.
-BOOST_FUSION_ADAPT_STRUCT(
-    client::ast::operation,
-    (char, operator_) // Note: you get bizarre errors if you have a comma here
-    (client::ast::operand, operand_)
-)
-BOOST_FUSION_ADAPT_STRUCT(
-    client::ast::expression,
-    (client::ast::operand, first)
-    (std::vector<client::ast::operation>, rest)
-)
-BOOST_FUSION_ADAPT_STRUCT(
-    client::ast::assignment,
-    (std::string, variable)
-    (client::ast::expression, expression_)
-)
-
-// Needed for code generation
-const std::string MainName = "main";
-static std::unique_ptr<llvm::Module> TheModule;
-static std::map<std::string, llvm::AllocaInst*> NamedValues;
-
-// With constant folding (the default):
-//typedef llvm::IRBuilder<> builder_type;
-// Without constant folding (more interesting IR output):
-typedef llvm::IRBuilder<true, llvm::NoFolder> builder_type;
-
-static builder_type Builder(llvm::getGlobalContext());
-
-// Output an error and return null rather than a valid LLVM Value pointer
-llvm::Value* ErrorV(const char *s)
+// Typedefs to simplify our definitions. Our calculator parser will be
+// iterating over characters in memory, whether a string or a mapped file.
+typedef const char* iterator_type;
+typedef client::calculator<iterator_type> calculator;
+
+// Count how many bytes get allocated for --stats. Only the compiler does
+// this, the library leaves the program's allocator alone.
+static void* countedAlloc(std::size_t size)
+{
+    client::allocatedBytes += size;
+
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size) { return countedAlloc(size); }
+void* operator new[](std::size_t size) { return countedAlloc(size); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
 {
-    std::cerr << "Error: " << s << std::endl;
-    return nullptr;
+    client::allocatedBytes += size;
+    return std::malloc(size ? size : 1);
 }
 
-// After we create the AST, process it in some manner
-namespace client { namespace ast {
-    // Output the AST visually
-    //
-    // We'll be creating one instance of this class and then calling the ()
-    // operators passing in the next item in the AST. This is called a
-    // 'functor' (nothing to do with that of category theory) or a 'function
-    // object.'
-    struct printer
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    client::allocatedBytes += size;
+    return std::malloc(size ? size : 1);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+// Which parser to use, or both to check that they agree
+enum class parser_kind { spirit, fast, both };
+
+// Parses programs with whichever parser was chosen. Create one per thread.
+struct source_parser
+{
+    source_parser(parser_kind kind, bool flat, bool optimize = false,
+        const client::parse_limits& limits = client::parse_limits())
+        : kind(kind), flat(flat), optimize(optimize), limits(limits),
+          flatAST(symbols), optimizedAST(symbols)
+    {
+    }
+
+    // Returns whether the whole string was a valid program. If not, the
+    // reason is in error.
+    bool operator()(llvm::StringRef str, client::ast::program& ast,
+        std::string& error) const
     {
-        typedef void result_type;
+        if (!withinLimits(str, false, error))
+            return false;
 
-        // When we get nothing, do nothing
-        void operator()(nil) const { }
+        // Where each parser stopped
+        std::size_t stopped = 0;
+        std::size_t stoppedFast = 0;
+        bool r = false;
+        bool rFast = false;
 
-        // If we get a number, print out the number
-        void operator()(float n) const
+        if (kind != parser_kind::fast)
         {
-            std::cout << n;
-        }
+            // Skip spaces
+            boost::spirit::ascii::space_type space;
 
-        // If we get a string, print out the variable name
-        void operator()(const std::string& s) const
-        {
-            std::cout << s;
+            // To parse, Spirit requires that we have iterators, so get the
+            // iterators for the program we were given
+            iterator_type iter = str.begin();
+            iterator_type end = str.end();
+
+            r = phrase_parse(iter, end, calc, space, ast);
+            stopped = iter - str.begin();
         }
 
-        // If we get an "operation", which consists of an operator (e.g. +) and
-        // another operand
-        void operator()(const operation& x) const
+        if (kind != parser_kind::spirit)
         {
-            // Continue looking at this subtree. E.g., if this operand is nil,
-            // then do nothing, but if it's a number, output it, etc.
-            boost::apply_visitor(*this, x.operand_);
+            client::ast::program fastAST;
+            const char* iter = str.data();
+
+            rFast = client::parse_fast(iter, str.data() + str.size(),
+                kind == parser_kind::fast ? ast : fastAST);
+            stoppedFast = iter - str.data();
 
-            // Display what operator this operation consisted of
-            switch (x.operator_)
+            if (kind == parser_kind::fast)
             {
-                case '+': std::cout << " +"; break;
-                case '-': std::cout << " -"; break;
-                case '*': std::cout << " *"; break;
-                case '/': std::cout << " /"; break;
-                default:  std::cout << " ?"; break;
+                r = rFast;
+                stopped = stoppedFast;
             }
-        }
-
-        // If we got an expression, process the first part and then all the
-        // other parts as well, outputting spaces between
-        void operator()(const expression& x) const
-        {
-            boost::apply_visitor(*this, x.first);
-
-            for (const operation& op : x.rest)
+            else if (r != rFast || stopped != stoppedFast ||
+                !client::ast::comparer()(ast, fastAST))
             {
-                std::cout << " ";
-                (*this)(op);
+                error = "Parsers disagree";
+                return false;
             }
         }
 
-        // For an assignment, output that the result will be read into this
-        // variable
-        void operator()(const assignment& x) const
+        return succeeded(r, stopped, str, error);
+    }
+
+    // Parse into the compact AST instead, which only the fast parser can
+    // do. The AST's memory is reused for the next program.
+    bool operator()(llvm::StringRef str, client::flat::program& ast,
+        std::string& error) const
+    {
+        ast.clear();
+
+        if (!withinLimits(str, true, error))
+            return false;
+
+        const char* iter = str.data();
+        bool r = client::parse_fast(iter, str.data() + str.size(), ast);
+
+        return succeeded(r, iter - str.data(), str, error);
+    }
+
+    calculator calc;
+    parser_kind kind;
+
+    // Whether to use the compact AST, and the one we reuse for each program
+    bool flat;
+
+    // Whether to optimize the AST, see optimizeAST(). The optimized program
+    // is always a compact AST, which is reused like flatAST.
+    bool optimize;
+
+    // What we refuse to parse, on top of the tree AST's own depth limit
+    client::parse_limits limits;
+
+    client::flat::symbol_table symbols;
+    client::flat::program flatAST;
+    client::flat::program optimizedAST;
+
+    // Returns whether the program is within the limits for the kind of AST,
+    // which parsing checks first. If not, the reason is in error.
+    bool withinLimits(llvm::StringRef str, bool flat,
+        std::string& error) const
+    {
+        const char* first = str.data();
+        const char* last = str.data() + str.size();
+
+        if (!client::checkLimits(first, last, limits, error))
+            return false;
+
+        // Anything deeper would run out of stack, see TreeMaxDepth
+        client::parse_limits tree;
+        tree.maxDepth = client::TreeMaxDepth;
+
+        if (!flat && !client::checkLimits(first, last, tree, error))
         {
-            (*this)(x.expression_);
-            std::cout << " =" << x.variable << " ";
+            error += " (use --flat-ast for deeper programs)";
+            return false;
         }
 
-        // For the whole thing
-        void operator()(const program& x) const
+        return true;
+    }
+
+private:
+    static bool succeeded(bool r, std::size_t stopped, llvm::StringRef str,
+        std::string& error)
+    {
+        // If the position doesn't match the end of the string, we stopped
+        // early because of some error
+        if (!r || stopped != str.size())
         {
-            // Don't just call (*this)(x) because then it'll call this same
-            // function creating an infinite loop. We want to call this
-            // function on what type it actually took on as part of the
-            // variant, i.e. whether it's an expression or assignment.
-            for (const program_line& line : x)
-                boost::apply_visitor(*this, line);
+            error = "Parsing failed, stopped at: \"" +
+                str.substr(stopped).str() + "\"";
+            return false;
         }
-    };
 
-    // From LLVM example
-    //
-    // Create an alloca instruction in the entry block of the function. This
-    // is used for mutable variables
-    static llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* func,
-        const std::string& variableName)
+        return true;
+    }
+};
+
+// Output the AST and then compile it, with the printer and compiler for
+// whichever kind of AST it is
+template <typename Printer, typename Compiler, typename AST>
+static llvm::Value* compileAST(CompilerContext& ctx, const AST& ast,
+    std::ostream* ast_out, client::stats* stats)
+{
+    // AST
+    if (ast_out)
     {
-        builder_type TmpBuilder(&func->getEntryBlock(),
-            func->getEntryBlock().begin());
-        return TmpBuilder.CreateAlloca(
-            llvm::Type::getDoubleTy(llvm::getGlobalContext()),
-            0, variableName.c_str());
+        Printer ast_print(*ast_out);
+        *ast_out << "AST: ";
+        ast_print(ast);
+        *ast_out << std::endl;
     }
 
-    // Go from AST to LLVM IR
-    struct compiler
+    if (stats)
+        stats->astNodes += client::countNodes(ast);
+
+    client::phase_timer timer(stats, client::phase::codegen);
+    Compiler ast_compile(ctx);
+    return ast_compile(ast);
+}
+
+// What was asked for on the command line
+struct options
+{
+    // Whether to run the code rather than just showing the IR
+    bool runJIT = false;
+
+    // Compile a file on multiple threads rather than being interactive
+    std::string batchFile;
+    unsigned int jobs = std::thread::hardware_concurrency();
+
+    // Or compile one big program from a file as we read it
+    std::string inputFile;
+
+    // Or answer requests on this socket, with jobs threads
+    std::string serveSocket;
+
+    // By default show the IR as it directly corresponds to the source
+    unsigned int optLevel = 0;
+
+    // The hand-written parser is much faster than the Spirit one
+    parser_kind parserKind = parser_kind::fast;
+
+    // Whether to parse into the compact AST rather than the tree
+    bool flat = false;
+
+    // Where to cache compiled programs, if anywhere
+    std::string cacheDir;
+    std::uint64_t cacheMB = 256;
+
+    // Whether to compile a kernel over columns of inputs rather than main
+    bool kernel = false;
+
+    // Whether to compile the whole batch into one function, see runFused()
+    bool fuse = false;
+
+    // Whether to fold constants, etc. before generating any code
+    bool optimizeAST = false;
+
+    // Whether to evaluate chains as balanced trees, and whether to also
+    // let LLVM use fast math
+    bool pairwise = false;
+    bool fastMath = false;
+
+    // What type the arithmetic is done in, or auto to pick for each program
+    client::numeric_kind numeric = client::numeric_kind::f64;
+
+    // Whether to generate SSA form directly rather than variables in memory
+    bool ssa = false;
+
+    // Whether variables carry over from one line of the REPL to the next
+    bool session = false;
+
+    // Whether to show where the time went when done, and whether as JSON
+    bool stats = false;
+    bool statsJSON = false;
+
+    // Programs too big or too deeply nested are an error
+    client::parse_limits limits;
+
+    // Whether to write the batch's programs to a file rather than output
+    // the IR, where, and what to call them. The CPU is as for -march, and
+    // if not given, the code runs on any CPU of this architecture.
+    client::emit_kind emit = client::emit_kind::none;
+    std::string outputFile;
+    std::string symbol = "wwl_program";
+    std::string cpu;
+};
+
+// Set up a context for compiling what was asked for
+static void configure(CompilerContext& ctx, const options& opts)
+{
+    ctx.Kernel = opts.kernel;
+    ctx.Fused = opts.fuse;
+    ctx.Session = opts.session;
+    ctx.SSA = opts.ssa;
+    ctx.Rebalance = opts.pairwise || opts.fastMath;
+    ctx.FastMath = opts.fastMath;
+    ctx.Numeric = opts.numeric;
+
+    // Optimize for the CPU we're writing code for, not the one we're on
+    if (opts.emit != client::emit_kind::none)
+        ctx.Target = createTargetMachine(opts.optLevel, opts.cpu);
+
+    ctx.reset();
+}
+
+// Everything other than the source code that changes what code we generate,
+// which has to be part of the cache key
+static std::string codegenOptions(const CompilerContext& ctx)
+{
+    return "-O" + std::to_string(ctx.OptLevel) +
+        (ctx.Kernel ? " kernel" : "") + (ctx.Fused ? " fused" : "") +
+        (ctx.SSA ? " ssa" : "") +
+        (ctx.FastMath ? " fast-math" : ctx.Rebalance ? " pairwise" : "") +
+        (ctx.Numeric != client::numeric_kind::f64 ?
+            std::string(" ") + client::numericName(ctx.Numeric) : "") + " " +
+        ctx.TheModule->getDataLayoutStr() + (ctx.Target ? " " +
+            ctx.Target->getTargetCPU().str() + " " +
+            ctx.Target->getTargetFeatureString().str() : "");
+}
+
+// Whether the program's arithmetic is on integers, which changes what the
+// AST optimizer can fold
+static bool integers(const CompilerContext& ctx)
+{
+    return ctx.Arithmetic == client::numeric_kind::i64;
+}
+
+// Parse one program and compile it into the context's module, which should
+// be fresh. Returns the main function, or null if parsing or compiling
+// failed, in which case the reason is in error.
+//
+// If there's a cache and the program is in it, the module is replaced with
+// the cached one, skipping everything else. Otherwise it's added to it.
+//
+// If there are stats, how long each part took and what we generated are
+// added to them. If ast_out isn't null, the AST is output to it before
+// compiling.
+static llvm::Function* compileProgram(CompilerContext& ctx,
+    source_parser& parse, llvm::StringRef str, std::string& error,
+    client::compile_cache* cache = nullptr, client::stats* stats = nullptr,
+    std::ostream* ast_out = nullptr)
+{
+    if (stats)
+        ++stats->programs;
+
+    std::string key;
+
+    if (cache)
     {
-        typedef llvm::Value* result_type;
+        // A program that's been compiled before still has to be refused if
+        // it's too deep or long, e.g. if the limits are lower now
+        if (!parse.withinLimits(str, parse.flat, error))
+            return nullptr;
 
-        // When we get nothing, do nothing
-        llvm::Value* operator()(nil) const { return nullptr; }
+        client::phase_timer timer(stats, client::phase::cache);
+        key = client::compile_cache::key(str, codegenOptions(ctx) +
+            (parse.optimize ? " ast" : ""));
 
-        // If we get a number, create an LLVM floating-point number
-        llvm::Value* operator()(float n) const
+        std::unique_ptr<llvm::Module> cached =
+            cache->lookup(key, *ctx.TheContext);
+
+        if (cached)
         {
-            return llvm::ConstantFP::get(llvm::getGlobalContext(),
-                    llvm::APFloat(n));
+            ctx.TheModule = std::move(cached);
+            return ctx.TheModule->getFunction(ctx.Kernel ? KernelName : MainName);
         }
+    }
+
+    // Must create the prototype before parsing since when making
+    // assignments we'll be initializing memory at the beginning of this
+    // main function
+    llvm::Function* mainFunction = ctx.Kernel ? createKernelPrototype(ctx) :
+        createMainPrototype(ctx);
+    llvm::Value* compiled;
+
+    // In a session the variables are used by later programs, so all of
+    // them have to be kept when optimizing
+    bool keepAssignments = ctx.Session;
 
-        // If we get a string, it's a variable name
-        llvm::Value* operator()(const std::string& s) const
+    // Actually parse the input
+    if (parse.flat)
+    {
         {
-            // Look up the variable name
-            std::map<std::string, llvm::AllocaInst*>::const_iterator it =
-                NamedValues.find(s);
+            client::phase_timer timer(stats, client::phase::parse);
 
-            if (it == NamedValues.end() || !it->second)
-                return ErrorV("Unknown variable name");
+            if (!parse(str, parse.flatAST, error))
+                return nullptr;
+        }
 
-            // Load the value from memory
-            return Builder.CreateLoad(it->second, s.c_str());
+        if (ctx.Numeric == client::numeric_kind::auto_)
+        {
+            client::phase_timer timer(stats, client::phase::simplify);
+            ctx.Arithmetic = client::inferNumericKind(parse.flatAST);
         }
 
-        // If we get an "operation", which consists of an operator (e.g. +) and
-        // another operand
-        llvm::Value* operator()(const operation& x, llvm::Value* lhs) const
+        if (parse.optimize)
         {
-            // Ignore if left-hand side null
-            if (!lhs)
-                return nullptr;
+            client::phase_timer timer(stats, client::phase::simplify);
+            client::optimizeAST(parse.flatAST, parse.optimizedAST,
+                keepAssignments, integers(ctx));
+        }
+
+        compiled = compileAST<client::flat::printer, client::flat::compiler>(
+            ctx, parse.optimize ? parse.optimizedAST : parse.flatAST, ast_out,
+            stats);
+    }
+    else
+    {
+        client::ast::program ast;
 
-            // Continue looking at this subtree. E.g., if this operand is nil,
-            // then do nothing, but if it's a number, make it floating point,
-            // etc.
-            llvm::Value* rhs = boost::apply_visitor(*this, x.operand_);
+        {
+            client::phase_timer timer(stats, client::phase::parse);
 
-            // Ignore if right-hand side null
-            if (!rhs)
+            if (!parse(str, ast, error))
                 return nullptr;
+        }
 
-            // Create the appropriate operation of the left- and right-hand
-            // sides
-            switch (x.operator_)
+        if (ctx.Numeric == client::numeric_kind::auto_)
+        {
+            client::phase_timer timer(stats, client::phase::simplify);
+            ctx.Arithmetic = client::inferNumericKind(ast);
+        }
+
+        if (parse.optimize)
+        {
             {
-                case '+': return Builder.CreateFAdd(lhs, rhs, "addtmp"); break;
-                case '-': return Builder.CreateFSub(lhs, rhs, "subtmp"); break;
-                case '*': return Builder.CreateFMul(lhs, rhs, "multmp"); break;
-                case '/': return Builder.CreateFDiv(lhs, rhs, "divtmp"); break;
-                default:  return ErrorV("invalid binary operator"); break;
+                client::phase_timer timer(stats, client::phase::simplify);
+                client::optimizeAST(ast, parse.optimizedAST, keepAssignments,
+                    integers(ctx));
             }
+
+            compiled = compileAST<client::flat::printer,
+                client::flat::compiler>(ctx, parse.optimizedAST, ast_out, stats);
+        }
+        else
+        {
+            compiled = compileAST<client::ast::printer,
+                client::ast::compiler>(ctx, ast, ast_out, stats);
         }
+    }
+
+    llvm::Function* program;
+
+    {
+        client::phase_timer timer(stats, client::phase::verify);
+        program = ctx.Kernel ?
+            createKernelFunction(ctx, compiled, mainFunction) :
+            createMainFunction(ctx, compiled, mainFunction);
+    }
+
+    if (!program)
+    {
+        error = "Error: " + (ctx.Error.empty() ?
+            std::string("failed to compile") : ctx.Error);
+        return nullptr;
+    }
+
+    if (stats)
+        client::countInstructions(*stats, *program);
+
+    {
+        client::phase_timer timer(stats, client::phase::optimize);
+        optimizeModule(*ctx.TheModule, ctx.OptLevel, ctx.Target.get());
+    }
+
+    if (cache)
+    {
+        client::phase_timer timer(stats, client::phase::cache);
+        cache->store(key, *ctx.TheModule);
+    }
+
+    return program;
+}
+
+// Output the compiled code, and for a kernel, which column is which input,
+// or for a fused function, which inputs and outputs are which
+static void printProgram(llvm::raw_ostream& out, const llvm::Function& program)
+{
+    if (program.getName() == KernelName || program.getName() == FusedName)
+    {
+        out << (program.getName() == KernelName ? "; Columns:" : "; Inputs:");
+
+        for (const std::string& name : kernelColumns(*program.getParent()))
+            out << " " << name;
+
+        out << "\n";
+    }
+
+    if (program.getName() == FusedName)
+    {
+        out << "; Outputs:";
+
+        for (const std::string& name : fusedOutputs(*program.getParent()))
+            out << " " << name;
+
+        out << "\n";
+    }
+
+    program.print(out);
+}
+
+// Where to write the batch: the output file, or if not given, the batch file
+// with the extension for what we're writing
+static std::string emitFilename(const options& opts)
+{
+    if (!opts.outputFile.empty())
+        return opts.outputFile;
+
+    llvm::SmallString<128> path(opts.batchFile);
+    llvm::sys::path::replace_extension(path, client::emitExtension(opts.emit));
+    return path.str().str();
+}
+
+// Read a batch, one program per line, skipping empty lines
+static bool readBatch(const std::string& filename,
+    std::vector<std::string>& programs)
+{
+    std::ifstream file(filename);
+
+    if (!file)
+    {
+        std::cerr << "Error: could not open " << filename << std::endl;
+        return false;
+    }
+
+    std::string line;
+
+    while (std::getline(file, line))
+        if (!line.empty())
+            programs.push_back(line);
+
+    return true;
+}
+
+// Link the programs from a batch, each as bitcode, into one module and write
+// it to the output file, named after the batch file if not given
+static int emitBatch(const options& opts,
+    const std::vector<std::string>& programs)
+{
+    std::unique_ptr<llvm::TargetMachine> target = createTargetMachine(
+        opts.optLevel, opts.cpu);
 
-        // If we got an expression, process the first part and then all the
-        // other parts as well
-        llvm::Value* operator()(const expression& x) const
+    if (!target)
+        return 1;
+
+    llvm::LLVMContext context;
+    llvm::Module module(llvm::sys::path::stem(opts.batchFile), context);
+    llvm::Linker linker(module);
+
+    for (const std::string& bitcode : programs)
+    {
+        llvm::Expected<std::unique_ptr<llvm::Module>> program =
+            llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode, ""), context);
+
+        if (!program)
+        {
+            std::cerr << "Error: " << llvm::toString(program.takeError())
+                << std::endl;
+            return 1;
+        }
+
+        // Returns true if it failed, after LLVM outputs why
+        if (linker.linkInModule(std::move(*program)))
+            return 1;
+    }
+
+    return client::emitModule(module, *target, opts.emit,
+        emitFilename(opts)) ? 0 : 1;
+}
+
+// Compile every line of the file as a separate program, spreading them over
+// the given number of threads. Each thread has its own context and parser so
+// they never have to wait on each other. The output is the IR of each
+// program in the same order as the input.
+static int runBatch(const options& opts, client::compile_cache* cache,
+    client::stats* stats)
+{
+    const std::string& filename = opts.batchFile;
+    std::vector<std::string> programs;
+
+    if (!readBatch(filename, programs))
+        return 1;
+
+    // What each program compiled to, or why it didn't
+    std::vector<std::string> results(programs.size());
+    // Not vector<bool>, since the threads set them at the same time
+    std::vector<char> succeeded(programs.size(), false);
+
+    // Threads take the next program that nobody has taken yet
+    std::atomic<std::size_t> next(0);
+
+    // Each thread keeps its own stats, added up when they're all done
+    std::vector<client::stats> threadStats(opts.jobs);
+
+    // An archive is written in order as the programs compile, so the only
+    // bitcode kept is for programs still waiting on an earlier one. Once
+    // one fails the file won't be kept, so the rest aren't written.
+    std::unique_ptr<client::archive_output> archive;
+    std::mutex archiveMutex;
+    std::vector<char> archiveReady(programs.size(), false);
+    std::size_t archived = 0;
+    bool archiveFailed = false;
+
+    if (opts.emit == client::emit_kind::archive)
+    {
+        archive = client::archive_output::open(emitFilename(opts));
+
+        if (!archive)
+            return 1;
+    }
+
+    auto archiveProgram = [&](std::size_t i, client::stats* stats)
+    {
+        std::lock_guard<std::mutex> lock(archiveMutex);
+        archiveReady[i] = true;
+
+        for (; archived < programs.size() && archiveReady[archived];
+            ++archived)
         {
-            llvm::Value* state = boost::apply_visitor(*this, x.first);
+            if (!succeeded[archived])
+            {
+                archiveFailed = true;
+                continue;
+            }
 
-            for (const operation& op : x.rest)
-                state = (*this)(op, state);
+            if (!archiveFailed)
+            {
+                client::phase_timer timer(stats, client::phase::emit);
+                archive->add(opts.symbol + "_" + std::to_string(archived + 1),
+                    results[archived]);
+            }
 
-            return state;
+            std::string().swap(results[archived]);
         }
+    };
+
+    auto worker = [&](client::stats* stats)
+    {
+        CompilerContext ctx(opts.optLevel);
+        source_parser parse(opts.parserKind, opts.flat, opts.optimizeAST,
+            opts.limits);
+        configure(ctx, opts);
 
-        // For an assignment, create the variable
-        llvm::Value* operator()(const assignment& x) const
+        for (std::size_t i = next++; i < programs.size(); i = next++)
         {
-            // Look at what is on the right side of the assignment operator
-            llvm::Value* expression = (*this)(x.expression_);
+            ctx.reset();
+
+            std::string error;
+            llvm::Function* program = compileProgram(ctx, parse,
+                programs[i], error, cache, stats);
 
-            // Only allocate memory and store the value if the expression
-            // evaluated, not if it returned null
-            if (expression)
+            if (program && opts.emit != client::emit_kind::none)
+            {
+                // Hand the module over as bitcode, since it belongs to this
+                // thread's context, to be linked with the others
+                client::phase_timer timer(stats, client::phase::emit);
+                program->setName(opts.symbol + "_" + std::to_string(i + 1));
+                llvm::raw_string_ostream out(results[i]);
+                llvm::WriteBitcodeToFile(*ctx.TheModule, out);
+                succeeded[i] = true;
+            }
+            else if (program)
+            {
+                client::phase_timer timer(stats, client::phase::emit);
+                llvm::raw_string_ostream out(results[i]);
+                printProgram(out, *program);
+                succeeded[i] = true;
+            }
+            else
             {
-                // We'll be adding the allocations to the main function
-                llvm::Function* func = TheModule->getFunction(MainName);
+                results[i] = error;
+            }
+
+            if (archive)
+                archiveProgram(i, stats);
+        }
+    };
+
+    std::vector<std::thread> threads;
+
+    for (unsigned int i = 0; i < opts.jobs; ++i)
+        threads.emplace_back(worker, stats ? &threadStats[i] : nullptr);
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    if (stats)
+        for (const client::stats& s : threadStats)
+            *stats += s;
+
+    int failed = 0;
+
+    // The IR goes out in big writes rather than a line at a time, other
+    // than before an error, so they still come out in order
+    llvm::raw_ostream& out = llvm::outs();
+
+    for (std::size_t i = 0; i < programs.size(); ++i)
+    {
+        if (succeeded[i])
+        {
+            if (opts.emit == client::emit_kind::none)
+                out << "; Program " << i + 1 << "\n" << results[i];
+        }
+        else
+        {
+            out.flush();
+            std::cerr << filename << ":" << i + 1 << ": " << results[i]
+                << std::endl;
+            ++failed;
+        }
+    }
 
-                // The main function better exist
-                assert(func);
+    out.flush();
 
-                // Create a variable and save the result to it
-                llvm::AllocaInst* alloca = CreateEntryBlockAlloca(func, x.variable);
-                Builder.CreateStore(expression, alloca);
-                NamedValues[x.variable] = alloca;
+    // Only keep the file if everything in it compiled
+    if (archive && !failed)
+    {
+        client::phase_timer timer(stats, client::phase::emit);
+        return archive->finish() ? 0 : 1;
+    }
+
+    if (opts.emit != client::emit_kind::none && !failed)
+    {
+        client::phase_timer timer(stats, client::phase::emit);
+        return emitBatch(opts, results);
+    }
+
+    return failed ? 1 : 0;
+}
+
+// Compile every line of the file into one function, out[k] = program k, so
+// that what the programs have in common is only worked out once. Programs
+// are numbered like runBatch() does, and each output is named after the
+// variable the program's last line assigns, or out<k> if it doesn't.
+static int runFused(const options& opts, client::stats* stats)
+{
+    const std::string& filename = opts.batchFile;
+    std::vector<std::string> programs;
+
+    if (!readBatch(filename, programs))
+        return 1;
+
+    if (programs.empty())
+    {
+        std::cerr << "Error: " << filename << " has no programs" << std::endl;
+        return 1;
+    }
+
+    CompilerContext ctx(opts.optLevel);
+    source_parser parse(opts.parserKind, opts.flat, true, opts.limits);
+    configure(ctx, opts);
+
+    // Every program is parsed before any of them are optimized, since
+    // they're optimized together
+    std::vector<client::ast::program> trees;
+    std::vector<client::flat::program> flats;
+    std::vector<std::string> names;
+    int failed = 0;
+
+    for (std::size_t i = 0; i < programs.size(); ++i)
+    {
+        client::phase_timer timer(stats, client::phase::parse);
+        std::string error;
+        std::string name = "out" + std::to_string(i + 1);
+        bool empty = false;
+
+        if (stats)
+            ++stats->programs;
+
+        if (parse.flat)
+        {
+            flats.emplace_back(parse.symbols);
+            client::flat::program& program = flats.back();
+
+            if (parse(programs[i], program, error) &&
+                !(empty = program.lines.empty()) &&
+                program.lines.back().variable != client::flat::no_symbol)
+                name = parse.symbols.name(program.lines.back().variable).str();
+        }
+        else
+        {
+            trees.emplace_back();
+            client::ast::program& program = trees.back();
+
+            if (parse(programs[i], program, error) &&
+                !(empty = program.empty()))
+            {
+                const client::ast::assignment* last =
+                    boost::get<client::ast::assignment>(&program.back());
+
+                if (last)
+                    name = last->variable;
             }
+        }
 
-            // Also return this expression so we don't get a failed-to-compile
-            // error
-            return expression;
+        if (empty)
+            error = "Error: nothing to compute";
+
+        if (!error.empty())
+        {
+            std::cerr << filename << ":" << i + 1 << ": " << error
+                << std::endl;
+            ++failed;
         }
 
-        // For the whole thing, return whatever was the last value
-        llvm::Value* operator()(const program& x) const
+        names.push_back(name);
+    }
+
+    if (failed)
+        return 1;
+
+    // They're all compiled together, so they can only use integers if
+    // that's right for every one of them
+    if (ctx.Numeric == client::numeric_kind::auto_)
+    {
+        client::phase_timer timer(stats, client::phase::simplify);
+        ctx.Arithmetic = client::numeric_kind::i64;
+
+        for (const client::flat::program& program : flats)
+            if (client::inferNumericKind(program) != client::numeric_kind::i64)
+                ctx.Arithmetic = client::numeric_kind::f64;
+
+        for (const client::ast::program& program : trees)
+            if (client::inferNumericKind(program) != client::numeric_kind::i64)
+                ctx.Arithmetic = client::numeric_kind::f64;
+    }
+
+    {
+        client::phase_timer timer(stats, client::phase::simplify);
+
+        if (parse.flat)
+            client::fuseAST(flats, parse.optimizedAST, integers(ctx));
+        else
+            client::fuseAST(trees, parse.optimizedAST, integers(ctx));
+    }
+
+    if (stats)
+        stats->astNodes += client::countNodes(parse.optimizedAST);
+
+    llvm::Function* fusedFunction = createFusedPrototype(ctx);
+    client::flat::compiler ast_compile(ctx);
+
+    {
+        client::phase_timer timer(stats, client::phase::codegen);
+        ast_compile(parse.optimizedAST);
+    }
+
+    llvm::Function* program;
+
+    {
+        client::phase_timer timer(stats, client::phase::verify);
+        program = createFusedFunction(ctx, ast_compile.lineValues, names,
+            fusedFunction);
+    }
+
+    if (!program)
+    {
+        std::cerr << "Error: " << (ctx.Error.empty() ? "failed to compile" :
+            ctx.Error) << std::endl;
+        return 1;
+    }
+
+    if (stats)
+        client::countInstructions(*stats, *program);
+
+    {
+        client::phase_timer timer(stats, client::phase::optimize);
+        optimizeModule(*ctx.TheModule, ctx.OptLevel, ctx.Target.get());
+    }
+
+    client::phase_timer timer(stats, client::phase::emit);
+
+    if (opts.emit != client::emit_kind::none)
+    {
+        program->setName(opts.symbol);
+        ctx.TheModule->setModuleIdentifier(opts.symbol);
+        return client::emitModule(*ctx.TheModule, *ctx.Target, opts.emit,
+            emitFilename(opts)) ? 0 : 1;
+    }
+
+    printProgram(llvm::outs(), *program);
+    return 0;
+}
+
+// Compile a file too big to read into memory, one ';'-separated statement at
+// a time straight from the mapped file, outputting the code for each as
+// soon as it's compiled. Like a session, each statement is a function of its
+// own, and variables are globals that carry over to the statements after.
+static int runInput(const options& opts, client::stats* stats)
+{
+    const std::string& filename = opts.inputFile;
+
+    client::statement_reader input;
+    std::string readError;
+
+    if (!input.open(filename, readError))
+    {
+        std::cerr << "Error: " << readError << std::endl;
+        return 1;
+    }
+
+    CompilerContext ctx(opts.optLevel);
+    source_parser parse(opts.parserKind, opts.flat, opts.optimizeAST,
+        opts.limits);
+    configure(ctx, opts);
+    ctx.Session = true;
+
+    llvm::StringRef statement;
+    std::size_t number = 0;
+    int failed = 0;
+
+    while (input.next(statement, readError))
+    {
+        ctx.reset();
+        ++number;
+
+        std::string error;
+        llvm::Function* program = compileProgram(ctx, parse, statement,
+            error, nullptr, stats);
+
+        if (!program)
         {
-            llvm::Value* lastValue = nullptr;
+            std::cerr << filename << ":" << number << ": " << error
+                << std::endl;
+            ++failed;
+            continue;
+        }
 
-            for (const program_line& line : x)
-                lastValue = boost::apply_visitor(*this, line);
+        program->setName("statement" + std::to_string(number));
 
-            return lastValue;
+        {
+            client::phase_timer timer(stats, client::phase::emit);
+            llvm::outs() << "; Statement " << number << "\n";
+            printProgram(llvm::outs(), *program);
         }
-    };
-}}
 
-namespace client
+        commitGlobals(ctx);
+    }
+
+    if (!readError.empty())
+    {
+        std::cerr << "Error: " << filename << ": " << readError << std::endl;
+        return 1;
+    }
+
+    return failed ? 1 : 0;
+}
+
+// Answer one request to the server. The first character of the request is
+// what to do with the program that follows: 'c' to compile it and send back
+// the IR, or 'e' to evaluate it and send back the result. The response is
+// "ok" or "error" on the first line, then the nanoseconds spent in each
+// phase on the second, e.g. "parse=1200 ... total=53000", then the IR,
+// result, or why it failed.
+static void handleRequest(CompilerContext& ctx, source_parser& parse,
+    client::jit& jit, const std::string& name, const std::string& request,
+    std::string& response)
 {
-    // Allow accessing via shorter namespaces
-    namespace qi = boost::spirit::qi;
-    namespace ascii = boost::spirit::ascii;
-
-    // The grammar
-    template <typename Iterator>
-    struct calculator
-        : qi::grammar<
-            // For example, iterating over a std::string or std::vector<char>
-            Iterator,
-            // What we'll be parsing into, the result
-            ast::program(),
-            // What we're skipping. In this case we probably don't care about
-            // whitespace.
-            ascii::space_type
-        >
-    {
-        calculator() : calculator::base_type(program)
-        {
-            // This is because we did BOOST_SPIRIT_NO_PREDEFINED_TERMINALS
-            qi::float_type float_;
-            qi::char_type char_;
-            qi::lexeme_type lexeme_;
-            qi::alnum_type alnum_;
-            qi::lit_type lit_;
-
-            // Our BNF grammar
-            //
-            // A program consists of one or more line with a semicolon separating
-            program = (program_line % ';') >> -lit_(";");
-
-            // The program line is either an assignment or an expression
-            program_line = assignment | expression;
-
-            // Assignment
-            //
-            // We do lit_("=") rather than char_('=') since we don't actually
-            // want to store the equal sign in the AST like we do when doing
-            // operators like + or -. We only want to store the expression and
-            // what variable we want to save that expressions's result to.
-            assignment = variable >> lit_("=") >> expression;
-
-            // Handle order of operations, do the addition/subtraction last
-            expression = term >> *(char_('+') >> term | char_('-') >> term);
-
-            // Do the multiplication/division before add/subtract
-            term = factor >> *(char_('*') >> factor | char_('/') >> factor);
-
-            // Do what's inside parenthesis before mult/div
-            factor = '(' >> expression >> ')' | float_ | variable;
-
-            // Variables are alphanumeric
-            //
-            // We use a lexeme here to make sure it doesn't ignore spaces, i.e.
-            // we want to make sure the variable name is only alphanumeric, not
-            // alphanumeric separated by spaces
-            variable %= lexeme_[+alnum_];
-
-            // Debugging
-            BOOST_SPIRIT_DEBUG_NODE(program);
-            BOOST_SPIRIT_DEBUG_NODE(program_line);
-            BOOST_SPIRIT_DEBUG_NODE(assignment);
-            BOOST_SPIRIT_DEBUG_NODE(expression);
-            BOOST_SPIRIT_DEBUG_NODE(term);
-            BOOST_SPIRIT_DEBUG_NODE(factor);
-            BOOST_SPIRIT_DEBUG_NODE(variable);
-        }
-
-        // Specify the iterator, result, and skip types for each
-        //
-        // program is a program, program_line is either an assignment or an
-        // expression, and assignment is an assignment.
-        //
-        // expression and term result type is expression() because they have
-        // the Kleene star, having one term first with a variable number of
-        // operator followed by more terms aftewards.
-        //
-        // factor doesn't. It's either a subexpression or an integer, which
-        // corresponds with our boost::variant that can be one of several
-        // types.
-        //
-        // The last is just a variable name, which is a string. Actually, it's
-        // a vector of chars that can be cast to a string.
-        qi::rule<Iterator, ast::program(), ascii::space_type> program;
-        qi::rule<Iterator, ast::program_line(), ascii::space_type> program_line;
-        qi::rule<Iterator, ast::assignment(), ascii::space_type> assignment;
-        qi::rule<Iterator, ast::expression(), ascii::space_type> expression;
-        qi::rule<Iterator, ast::expression(), ascii::space_type> term;
-        qi::rule<Iterator, ast::operand(), ascii::space_type> factor;
-        qi::rule<Iterator, std::string(), ascii::space_type> variable;
+    std::uint64_t start = client::wallTime();
+    client::stats stats;
+    std::string error;
+    std::string output;
+
+    if (request.empty() || (request[0] != 'c' && request[0] != 'e'))
+    {
+        error = "Requests start with c to compile or e to evaluate";
+    }
+    else
+    {
+        char kind = request[0];
+        llvm::StringRef program = llvm::StringRef(request).drop_front();
+
+        ctx.reset();
+        ctx.TheModule->setDataLayout(jit.getDataLayout());
+
+        llvm::Function* compiled = compileProgram(ctx, parse, program, error,
+            nullptr, &stats);
+
+        if (compiled && kind == 'c')
+        {
+            client::phase_timer timer(&stats, client::phase::emit);
+            llvm::raw_string_ostream out(output);
+            printProgram(out, *compiled);
+        }
+        else if (compiled)
+        {
+            // Every worker has its own name for the function, so they can
+            // all be in the JIT at once
+            client::phase_timer timer(&stats, client::phase::emit);
+            compiled->setName(name);
+            double result;
+
+            if (jit.run(std::move(ctx.TheModule), std::move(ctx.TheContext),
+                    name, result))
+            {
+                std::ostringstream out;
+                out << std::setprecision(17) << result;
+                output = out.str();
+            }
+            else
+            {
+                error = "Could not run the program";
+            }
+        }
+    }
+
+    std::ostringstream out;
+    out << (error.empty() ? "ok" : "error") << "\n";
+
+    for (int i = 0; i < static_cast<int>(client::phase::count); ++i)
+        out << client::phaseName(static_cast<client::phase>(i)) << "="
+            << stats.wall[i] << " ";
+
+    out << "total=" << client::wallTime() - start << "\n"
+        << (error.empty() ? output : error);
+    response = out.str();
+}
+
+// Answer requests on the socket until we're stopped. Each worker has its own
+// context and parser, built once, and they share the JIT.
+static int runServer(const options& opts)
+{
+    // What it evaluates only runs once, so the quicker the code is
+    // generated, the better
+    std::unique_ptr<client::jit> jit = client::jit::create(
+        llvm::CodeGenOpt::None);
+
+    if (!jit)
+        return 1;
+
+    std::atomic<unsigned int> workers(0);
+
+    auto createHandler = [&]() -> client::request_handler
+    {
+        std::shared_ptr<CompilerContext> ctx =
+            std::make_shared<CompilerContext>(opts.optLevel);
+        std::shared_ptr<source_parser> parse = std::make_shared<source_parser>(
+            opts.parserKind, opts.flat, opts.optimizeAST, opts.limits);
+        configure(*ctx, opts);
+
+        std::string name = "request" + std::to_string(workers++);
+        client::jit* shared = jit.get();
+
+        return [ctx, parse, shared, name](const std::string& request,
+            std::string& response)
+        {
+            handleRequest(*ctx, *parse, *shared, name, request, response);
+        };
     };
+
+    return client::serve(opts.serveSocket, opts.jobs, createHandler) ? 0 : 1;
 }
 
-// We need to create the prototype and the entry point before compiling the
-// code since during an assignment it adds allocations to this entry point.
-llvm::Function* createMainPrototype()
+static void printCacheStats(const client::compile_cache& cache)
 {
-    // Make the function type: double()
-    std::vector<llvm::Type*> noArguments;
-    llvm::FunctionType* functionType = llvm::FunctionType::get(
-        llvm::Type::getDoubleTy(llvm::getGlobalContext()), noArguments, false);
-    llvm::Function* func = llvm::Function::Create(
-        functionType, llvm::Function::ExternalLinkage, MainName, TheModule.get());
-
-    // Create a new basic block to start insertion into
-    llvm::BasicBlock* basicBlock = llvm::BasicBlock::Create(
-        llvm::getGlobalContext(), "entry", func);
-    Builder.SetInsertPoint(basicBlock);
-
-    return func;
+    std::cerr << "Cache: " << cache.hits() << " hits, " << cache.misses()
+        << " misses, " << cache.evictions() << " evictions" << std::endl;
 }
 
-// Take some code, e.g. assignment, and wrap it in a main function so that
-// it'll actually be able to do something
-llvm::Function* createMainFunction(llvm::Value* body,
-        llvm::Function* func = nullptr)
+static void usage(const char* name)
 {
-    // If we don't get the function directly, try to find it
-    if (!func)
+    std::cerr << "Usage: " << name << " [options] [--jit]" << std::endl
+        << "       " << name << " [options] --batch <file> [-j <threads>]"
+        << std::endl
+        << "       " << name << " [options] --fuse --batch <file>" << std::endl
+        << "       " << name << " [options] --input <file>" << std::endl
+        << "       " << name << " [options] -c|-S|--emit=<kind> [-o <file>]"
+        << " --batch <file>" << std::endl
+        << "       " << name << " [options] --serve <socket> [-j <threads>]"
+        << std::endl
+        << "Options:" << std::endl
+        << "  -O<level>                     optimization level, 0 to 3"
+        << std::endl
+        << "  --parser=spirit|fast|both     parser to use, or both to check"
+        << " they agree" << std::endl
+        << "  --flat-ast                    use the compact AST (fast parser"
+        << " only)" << std::endl
+        << "  --cache-dir <dir>             reuse programs compiled before"
+        << std::endl
+        << "  --cache-size <MB>             maximum size of the cache"
+        << " (default 256)" << std::endl
+        << "  --kernel                      compile a loop over columns of"
+        << " inputs" << std::endl
+        << "  --fuse                        compile the batch into one"
+        << " function, sharing what" << std::endl
+        << "                                the programs have in common"
+        << std::endl
+        << "  --optimize-ast                fold constants, share common"
+        << " subexpressions, and" << std::endl
+        << "                                drop unused assignments before"
+        << " generating code" << std::endl
+        << "  --pairwise                    evaluate chains of + and * as"
+        << " balanced trees" << std::endl
+        << "  --fast-math                   the same, and let LLVM assume"
+        << " there are no NaNs, etc." << std::endl
+        << "  --numeric=f32|f64|i64|auto    do the arithmetic on floats,"
+        << " doubles (default), 64-bit" << std::endl
+        << "                                integers, or integers when that"
+        << " gives the same answer" << std::endl
+        << "  --ssa                         keep variables in registers, not"
+        << " memory" << std::endl
+        << "  --session                     keep variables from one line to"
+        << " the next" << std::endl
+        << "  --stats[=json]                show time spent in each phase"
+        << " when done" << std::endl
+        << "  --max-depth <n>               reject programs with parenthesis"
+        << " nested deeper" << std::endl
+        << "  --max-length <n>              reject programs with more"
+        << " characters" << std::endl
+        << "  -c, -S, --emit=obj|asm|bc|ll|so|archive" << std::endl
+        << "                                write the batch to an object file,"
+        << " assembly, bitcode," << std::endl
+        << "                                IR, a shared library, or an archive"
+        << " of bitcode" << std::endl
+        << "  -o <file>                     where to write it, or - for stdout"
+        << std::endl
+        << "  --symbol <name>               name the programs <name>_1,"
+        << " <name>_2, etc." << std::endl
+        << "  -march=<cpu>                  generate code for the CPU, e.g."
+        << " native" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    options opts;
+
+    for (int i = 1; i < argc; ++i)
     {
-        // See if we've already created the prototype
-        func = TheModule->getFunction(MainName);
+        std::string arg = argv[i];
 
-        // If it doesn't exist, create it
-        if (!func)
-            func = createMainPrototype();
+        if (arg == "--jit")
+        {
+            opts.runJIT = true;
+        }
+        else if (arg == "--batch" && i + 1 < argc)
+        {
+            opts.batchFile = argv[++i];
+        }
+        else if (arg == "--input" && i + 1 < argc)
+        {
+            opts.inputFile = argv[++i];
+        }
+        else if (arg == "--serve" && i + 1 < argc)
+        {
+            opts.serveSocket = argv[++i];
+        }
+        else if (arg == "-c")
+        {
+            opts.emit = client::emit_kind::obj;
+        }
+        else if (arg == "-S")
+        {
+            opts.emit = client::emit_kind::asm_;
+        }
+        else if (arg.compare(0, 7, "--emit=") == 0 &&
+            client::emitKind(arg.substr(7)) != client::emit_kind::none)
+        {
+            opts.emit = client::emitKind(arg.substr(7));
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            opts.outputFile = argv[++i];
+        }
+        else if (arg == "--symbol" && i + 1 < argc)
+        {
+            opts.symbol = argv[++i];
+        }
+        else if (arg.compare(0, 7, "-march=") == 0 && arg.size() > 7)
+        {
+            opts.cpu = arg.substr(7);
+        }
+        else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 &&
+            arg[2] >= '0' && arg[2] <= '3')
+        {
+            opts.optLevel = arg[2] - '0';
+        }
+        else if (arg == "--parser=spirit")
+        {
+            opts.parserKind = parser_kind::spirit;
+        }
+        else if (arg == "--parser=fast")
+        {
+            opts.parserKind = parser_kind::fast;
+        }
+        else if (arg == "--parser=both")
+        {
+            opts.parserKind = parser_kind::both;
+        }
+        else if (arg == "--flat-ast")
+        {
+            opts.flat = true;
+        }
+        else if (arg == "--cache-dir" && i + 1 < argc)
+        {
+            opts.cacheDir = argv[++i];
+        }
+        else if (arg == "--cache-size" && i + 1 < argc)
+        {
+            opts.cacheMB = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--kernel")
+        {
+            opts.kernel = true;
+        }
+        else if (arg == "--fuse")
+        {
+            opts.fuse = true;
+        }
+        else if (arg == "--optimize-ast")
+        {
+            opts.optimizeAST = true;
+        }
+        else if (arg == "--pairwise")
+        {
+            opts.pairwise = true;
+        }
+        else if (arg == "--fast-math")
+        {
+            opts.fastMath = true;
+        }
+        else if (arg.compare(0, 10, "--numeric=") == 0 &&
+            client::numericKind(arg.substr(10)) != client::numeric_kind::none)
+        {
+            opts.numeric = client::numericKind(arg.substr(10));
+        }
+        else if (arg == "--ssa")
+        {
+            opts.ssa = true;
+        }
+        else if (arg == "--session")
+        {
+            opts.session = true;
+        }
+        else if (arg == "--stats")
+        {
+            opts.stats = true;
+        }
+        else if (arg == "--stats=json")
+        {
+            opts.stats = true;
+            opts.statsJSON = true;
+        }
+        else if (arg == "--max-depth" && i + 1 < argc)
+        {
+            opts.limits.maxDepth = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--max-length" && i + 1 < argc)
+        {
+            opts.limits.maxLength = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-j" && i + 1 < argc)
+        {
+            opts.jobs = std::atoi(argv[++i]);
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-        // For some reason couldn't generate the prototype
-        if (!func)
-            return nullptr;
+    // In case hardware_concurrency() doesn't know
+    if (opts.jobs == 0)
+        opts.jobs = 1;
+
+    // The compact AST needs the fast parser, and the JIT only runs main.
+    // Sessions are only for the REPL, and since what a line compiles to
+    // depends on the lines before it, they can't be cached. The same goes
+    // for the statements of --input, which only outputs the code since
+    // keeping all of it in the JIT would use memory for the whole file.
+    // Only a batch of programs can be written to a file, or fused, which
+    // isn't cached since the cache holds one program per entry. The server
+    // compiles each request on its own, and its clients decide what to run.
+    bool input = !opts.inputFile.empty();
+    bool emit = opts.emit != client::emit_kind::none;
+    bool serve = !opts.serveSocket.empty();
+
+    if ((opts.flat && opts.parserKind != parser_kind::fast) ||
+        (opts.kernel && opts.runJIT) ||
+        (opts.session && (opts.kernel || !opts.batchFile.empty() ||
+            !opts.cacheDir.empty())) ||
+        (input && (opts.runJIT || opts.kernel || opts.session ||
+            !opts.batchFile.empty() || !opts.cacheDir.empty())) ||
+        (emit && opts.batchFile.empty()) ||
+        (opts.fuse && (opts.batchFile.empty() || opts.kernel ||
+            opts.session || !opts.cacheDir.empty())) ||
+        (serve && (opts.runJIT || opts.kernel || opts.session || input ||
+            emit || !opts.batchFile.empty() || !opts.cacheDir.empty())) ||
+        (!emit && (!opts.outputFile.empty() || !opts.cpu.empty())))
+    {
+        usage(argv[0]);
+        return 1;
     }
 
-    // Create a new basic block to start insertion into
-    llvm::BasicBlock* basicBlock = llvm::BasicBlock::Create(
-        llvm::getGlobalContext(), "entry", func);
-    Builder.SetInsertPoint(basicBlock);
+    std::unique_ptr<client::compile_cache> cache;
 
-    // Create body through parsing the actual code
-    llvm::Value* returnValue = body;
+    if (!opts.cacheDir.empty())
+        cache = std::make_unique<client::compile_cache>(opts.cacheDir,
+            opts.cacheMB * 1024 * 1024);
 
-    if (returnValue)
+    // Only measure if asked, since that's not free either
+    client::stats stats;
+    client::stats* statsPtr = opts.stats ? &stats : nullptr;
+    std::uint64_t start = client::wallTime();
+
+    if (serve)
+        return runServer(opts);
+
+    if (input)
     {
-        // Finish off the function
-        Builder.CreateRet(returnValue);
+        int result = runInput(opts, statsPtr);
 
-        // Validate the generated code, checking for consistency
-        llvm::verifyFunction(*func);
+        if (statsPtr)
+            client::printStats(std::cerr, stats, client::wallTime() - start,
+                opts.statsJSON);
 
-        return func;
+        return result;
     }
 
-    // Error reading body, remove function
-    func->eraseFromParent();
-    return nullptr;
-}
+    if (!opts.batchFile.empty())
+    {
+        if (opts.runJIT)
+        {
+            usage(argv[0]);
+            return 1;
+        }
 
-int main()
-{
-    std::cout << "WwuLang Compiler" << std::endl;
+        // Rather than finding out the CPU doesn't exist once everything's
+        // compiled
+        if (opts.emit != client::emit_kind::none &&
+            !createTargetMachine(opts.optLevel, opts.cpu))
+            return 1;
+
+        int result = opts.fuse ? runFused(opts, statsPtr) :
+            runBatch(opts, cache.get(), statsPtr);
 
-    // Typedefs to simplify our definitions. Our calculator parser will be
-    // iterating over a string.
-    typedef std::string::const_iterator iterator_type;
-    typedef client::calculator<iterator_type> calculator;
+        if (cache)
+            printCacheStats(*cache);
 
-    // Skip spaces
-    boost::spirit::ascii::space_type space;
+        if (statsPtr)
+            client::printStats(std::cerr, stats, client::wallTime() - start,
+                opts.statsJSON);
+
+        return result;
+    }
+
+    std::cout << "WwuLang Compiler" << std::endl;
 
     // Parser
-    calculator calc;
+    source_parser parse(opts.parserKind, opts.flat, opts.optimizeAST,
+        opts.limits);
+
+    // Everything the compiler generates goes in here
+    CompilerContext ctx(opts.optLevel);
+    configure(ctx, opts);
+
+    // Only set up the JIT once, not for every line
+    std::unique_ptr<client::jit> jit;
+
+    if (opts.runJIT)
+    {
+        jit = client::jit::create();
+
+        if (!jit)
+            return 1;
+    }
+
+    // In a session each line is a function of its own, line1, line2, etc.
+    unsigned int lineNumber = 0;
 
     while (true)
     {
         // Recreate this every time we compile something so we don't have
-        // multiple entry points, old code, etc.
-        TheModule = llvm::make_unique<llvm::Module>(
-                "WwuLang JIT Compiler", llvm::getGlobalContext());
+        // multiple entry points, old code, etc. In a session the variables
+        // carry over, but only the new line gets compiled.
+        ctx.reset();
 
-        // Reset so variables don't carry over from the last compile
-        NamedValues.clear();
+        if (jit)
+            ctx.TheModule->setDataLayout(jit->getDataLayout());
 
         // Interactively get user input to parse
         std::cout << "> ";
@@ -544,49 +1440,62 @@ int main()
         if (str.empty() || str == "q" || str == "Q")
             break;
 
-        // To parse, Spirit requires that we have iterators, so get the
-        // iterators for the string we just read
-        std::string::const_iterator iter = str.begin();
-        std::string::const_iterator end = str.end();
+        std::string error;
+        llvm::Function* program = compileProgram(ctx, parse, str, error,
+            cache.get(), statsPtr, &std::cout);
 
-        // Must create the prototype before parsing since when making
-        // assignments we'll be initializing memory at the beginning of this
-        // main function
-        llvm::Function* mainFunction = createMainPrototype();
+        if (!program)
+        {
+            std::cout << error << std::endl;
+            continue;
+        }
 
-        // Actually parse the input
-        client::ast::program ast;
-        client::ast::printer ast_print;
-        client::ast::compiler ast_compile;
-        bool r = phrase_parse(iter, end, calc, space, ast);
+        // The JIT keeps the earlier lines around since they define the
+        // globals, so their functions need different names
+        std::string name = MainName;
 
-        // If the iterator matches the end iterator of the string,
-        // we've parsed the entire string
-        if (r && iter == end)
+        if (opts.session)
         {
-            // AST
-            std::cout << "AST: ";
-            ast_print(ast);
-            std::cout << std::endl;
+            name = "line" + std::to_string(++lineNumber);
+            program->setName(name);
+        }
 
-            // LLVM IR text assembly output
-            std::cout << "Compiled: " << std::endl;
-            llvm::Value* compiled = ast_compile(ast);
-            llvm::Function* program = createMainFunction(compiled, mainFunction);
+        // Run it, which hands the module and context off to the JIT
+        if (jit)
+        {
+            client::phase_timer timer(statsPtr, client::phase::emit);
+            double result;
 
-            if (program)
-                program->dump();
-            else
-                std::cout << "Error: failed to compile" << std::endl;
+            if (!jit->run(std::move(ctx.TheModule), std::move(ctx.TheContext),
+                    name, result, opts.session))
+                continue;
+
+            std::cout << "Result: " << result << std::endl;
         }
-        // If not, then we stopped early because of some error
+        // LLVM IR text assembly output
         else
         {
-            std::string rest(iter, end);
-            std::cout << "Parsing failed, stopped at: \""
-                << rest << "\"" << std::endl;
+            client::phase_timer timer(statsPtr, client::phase::emit);
+            std::cout << "Compiled: " << std::endl;
+
+            // stderr isn't buffered, so print it all first and then write
+            // it in one go
+            llvm::SmallString<4096> ir;
+            llvm::raw_svector_ostream out(ir);
+            printProgram(out, *program);
+            llvm::errs() << ir;
         }
+
+        if (opts.session)
+            commitGlobals(ctx);
     }
 
+    if (cache)
+        printCacheStats(*cache);
+
+    if (statsPtr)
+        client::printStats(std::cerr, stats, client::wallTime() - start,
+            opts.statsJSON);
+
     return 0;
 }
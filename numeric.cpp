@@ -0,0 +1,215 @@
+/*
+ * WwuLang Compiler
+ *
+ * Which type the numbers in a program are
+ */
+
+#include "numeric.h"
+
+#include <map>
+#include <cmath>
+#include <vector>
+
+namespace client
+{
+    namespace
+    {
+        // Doubles have a 53 bit mantissa, so every integer up to this is
+        // exact, but not every one after it
+        const double MaxExact = 9007199254740992.0;
+
+        // Whether an integer would be exactly the same. Doubles have a
+        // negative zero but integers don't, and NaNs and infinities aren't
+        // integers at all.
+        bool exactInteger(double value)
+        {
+            return value == std::trunc(value) && std::fabs(value) <= MaxExact &&
+                !(value == 0 && std::signbit(value));
+        }
+
+        // Do the arithmetic like the code using doubles would. Returns
+        // whether integers would have given the same result, e.g. not for
+        // 1 / 2.
+        bool evaluate(char op, double lhs, double rhs, double& result)
+        {
+            switch (op)
+            {
+                case '+': result = lhs + rhs; break;
+                case '-': result = lhs - rhs; break;
+                case '*': result = lhs * rhs; break;
+                case '/': result = lhs / rhs; break;
+                default:  return false;
+            }
+
+            return exactInteger(result);
+        }
+
+        // Run the tree AST, stopping at the first thing integers wouldn't
+        // do exactly. Each part leaves what it came to in value.
+        struct tree_evaluator
+        {
+            typedef bool result_type;
+
+            bool operator()(float n)
+            {
+                value = n;
+                return exactInteger(value);
+            }
+
+            // Only variables the program has already assigned have a value
+            // we know, otherwise it's an input
+            bool operator()(const std::string& s)
+            {
+                std::map<std::string, double>::const_iterator it =
+                    variables.find(s);
+
+                if (it == variables.end())
+                    return false;
+
+                value = it->second;
+                return true;
+            }
+
+            bool operator()(const ast::expression& x)
+            {
+                if (!boost::apply_visitor(*this, x.first))
+                    return false;
+
+                for (const ast::operation& op : x.rest)
+                {
+                    double lhs = value;
+
+                    if (!boost::apply_visitor(*this, op.operand_) ||
+                        !evaluate(op.operator_, lhs, value, value))
+                        return false;
+                }
+
+                return true;
+            }
+
+            bool operator()(const ast::assignment& x)
+            {
+                if (!(*this)(x.expression_))
+                    return false;
+
+                variables[x.variable] = value;
+                return true;
+            }
+
+            std::map<std::string, double> variables;
+            double value;
+        };
+    }
+
+    numeric_kind numericKind(const std::string& name)
+    {
+        if (name == "f32")  return numeric_kind::f32;
+        if (name == "f64")  return numeric_kind::f64;
+        if (name == "i64")  return numeric_kind::i64;
+        if (name == "auto") return numeric_kind::auto_;
+        return numeric_kind::none;
+    }
+
+    const char* numericName(numeric_kind kind)
+    {
+        switch (kind)
+        {
+            case numeric_kind::f32:   return "f32";
+            case numeric_kind::f64:   return "f64";
+            case numeric_kind::i64:   return "i64";
+            case numeric_kind::auto_: return "auto";
+            default:                  return "";
+        }
+    }
+
+    numeric_kind inferNumericKind(const ast::program& program)
+    {
+        tree_evaluator evaluator;
+
+        for (const ast::program_line& line : program)
+            if (!boost::apply_visitor(evaluator, line))
+                return numeric_kind::f64;
+
+        return program.empty() ? numeric_kind::f64 : numeric_kind::i64;
+    }
+
+    numeric_kind inferNumericKind(const flat::program& program)
+    {
+        // What each node came to, and on which line, since what a variable
+        // is may change between lines. Like everything else using the
+        // compact AST, this doesn't recurse.
+        std::vector<double> values(program.nodes.size());
+        std::vector<std::size_t> line(program.nodes.size(), 0);
+        std::vector<double> variables(program.symbols.size());
+        std::vector<bool> assigned(program.symbols.size(), false);
+        std::vector<flat::index> pending;
+        std::size_t lineNumber = 0;
+
+        for (const flat::line& l : program.lines)
+        {
+            ++lineNumber;
+            pending.push_back(l.root);
+
+            while (!pending.empty())
+            {
+                flat::index n = pending.back();
+                const flat::node& current = program.nodes[n];
+
+                if (line[n] == lineNumber)
+                {
+                    pending.pop_back();
+                    continue;
+                }
+
+                // Both sides go first
+                if (current.kind == flat::node::operation &&
+                    !(line[current.lhs] == lineNumber &&
+                      line[current.rhs] == lineNumber))
+                {
+                    if (line[current.rhs] != lineNumber)
+                        pending.push_back(current.rhs);
+
+                    if (line[current.lhs] != lineNumber)
+                        pending.push_back(current.lhs);
+
+                    continue;
+                }
+
+                pending.pop_back();
+                line[n] = lineNumber;
+
+                switch (current.kind)
+                {
+                    case flat::node::number:
+                        values[n] = current.value;
+
+                        if (!exactInteger(values[n]))
+                            return numeric_kind::f64;
+                        break;
+
+                    case flat::node::variable:
+                        if (!assigned[current.name])
+                            return numeric_kind::f64;
+
+                        values[n] = variables[current.name];
+                        break;
+
+                    case flat::node::operation:
+                    default:
+                        if (!evaluate(current.operator_, values[current.lhs],
+                                values[current.rhs], values[n]))
+                            return numeric_kind::f64;
+                        break;
+                }
+            }
+
+            if (l.variable != flat::no_symbol)
+            {
+                variables[l.variable] = values[l.root];
+                assigned[l.variable] = true;
+            }
+        }
+
+        return program.lines.empty() ? numeric_kind::f64 : numeric_kind::i64;
+    }
+}
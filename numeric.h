@@ -0,0 +1,43 @@
+/*
+ * WwuLang Compiler
+ *
+ * Which type the numbers in a program are, e.g. 64-bit integers rather than
+ * doubles, and working out which one a program can use
+ */
+
+#ifndef WWULANG_NUMERIC_H
+#define WWULANG_NUMERIC_H
+
+#include <string>
+
+#include "ast.h"
+#include "flat_ast.h"
+
+namespace client
+{
+    // Like the compiler options of the same names. With auto_, each program
+    // is checked with inferNumericKind() to pick one of the others.
+    enum class numeric_kind { none, f32, f64, i64, auto_ };
+
+    // Get the kind from what --numeric= is given, e.g. "f32". Returns
+    // numeric_kind::none if it isn't one of them.
+    numeric_kind numericKind(const std::string& name);
+
+    // The name of the kind, e.g. "f32", for the cache key
+    const char* numericName(numeric_kind kind);
+
+    // Work out which type the program can use without changing its answer,
+    // which is numeric_kind::i64 if it gets exactly the same results as
+    // with doubles, and otherwise numeric_kind::f64.
+    //
+    // Using integers is only exact if every number the program starts from
+    // is an integer and nothing it works out goes past 2^53, where doubles
+    // stop being exact, e.g. it doesn't divide 1 by 2. We can only know
+    // that for the numbers it's given in its source, not for its inputs,
+    // e.g. parameters, kernel columns, or variables from an earlier program
+    // in a session, so a program with any inputs uses doubles.
+    numeric_kind inferNumericKind(const ast::program& program);
+    numeric_kind inferNumericKind(const flat::program& program);
+}
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ * WwuLang Compiler
+ *
+ * Running LLVM's optimization passes over the compiled code
+ */
+
+#include "optimizer.h"
+
+#include <mutex>
+#include <iostream>
+
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Scalar/Reassociate.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
+
+void optimizeModule(llvm::Module& module, unsigned int level,
+    llvm::TargetMachine* target)
+{
+    if (level == 0)
+        return;
+
+    // The passes get information about the code from these, and they all
+    // have to know about each other
+    llvm::LoopAnalysisManager loopAnalysis;
+    llvm::FunctionAnalysisManager functionAnalysis;
+    llvm::CGSCCAnalysisManager cgsccAnalysis;
+    llvm::ModuleAnalysisManager moduleAnalysis;
+
+    llvm::PassBuilder passBuilder(target);
+    passBuilder.registerModuleAnalyses(moduleAnalysis);
+    passBuilder.registerCGSCCAnalyses(cgsccAnalysis);
+    passBuilder.registerFunctionAnalyses(functionAnalysis);
+    passBuilder.registerLoopAnalyses(loopAnalysis);
+    passBuilder.crossRegisterProxies(loopAnalysis, functionAnalysis,
+        cgsccAnalysis, moduleAnalysis);
+
+    llvm::ModulePassManager passes;
+
+    if (level == 1)
+    {
+        llvm::FunctionPassManager functionPasses;
+
+        // Turn the alloca/load/store of each variable into SSA registers
+        functionPasses.addPass(llvm::PromotePass());
+        // Simple "peephole" optimizations and bit-twiddling
+        functionPasses.addPass(llvm::InstCombinePass());
+        // Reassociate expressions, e.g. so constants end up together
+        functionPasses.addPass(llvm::ReassociatePass());
+        // Eliminate common subexpressions
+        functionPasses.addPass(llvm::GVNPass());
+        // Simplify the control flow graph, e.g. delete unreachable blocks
+        functionPasses.addPass(llvm::SimplifyCFGPass());
+
+        passes.addPass(llvm::createModuleToFunctionPassAdaptor(
+            std::move(functionPasses)));
+    }
+    else
+    {
+        passes = passBuilder.buildPerModuleDefaultPipeline(level == 2 ?
+            llvm::OptimizationLevel::O2 : llvm::OptimizationLevel::O3);
+    }
+
+    passes.run(module, moduleAnalysis);
+}
+
+void initializeNativeTarget()
+{
+    // Registering the target isn't thread safe
+    static std::once_flag once;
+
+    std::call_once(once, []()
+    {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+    });
+}
+
+std::unique_ptr<llvm::TargetMachine> createHostTargetMachine(unsigned int level)
+{
+    return createTargetMachine(level, "native");
+}
+
+std::unique_ptr<llvm::TargetMachine> createTargetMachine(unsigned int level,
+    const std::string& cpu)
+{
+    initializeNativeTarget();
+
+    // This detects the CPU name and features the same way the JIT does
+    llvm::Expected<llvm::orc::JITTargetMachineBuilder> builder =
+        llvm::orc::JITTargetMachineBuilder::detectHost();
+
+    if (!builder)
+    {
+        std::cerr << "Error: " << llvm::toString(builder.takeError())
+            << std::endl;
+        return nullptr;
+    }
+
+    // Otherwise keep the host's architecture and OS but not its CPU
+    if (cpu != "native")
+    {
+        builder = llvm::orc::JITTargetMachineBuilder(builder->getTargetTriple());
+        builder->setCPU(cpu);
+    }
+
+    // The builder is meant for the JIT, which would use the large code model
+    builder->setRelocationModel(llvm::Reloc::PIC_);
+    builder->setCodeModel(llvm::CodeModel::Small);
+    builder->setCodeGenOptLevel(level == 0 ? llvm::CodeGenOpt::None :
+        level == 1 ? llvm::CodeGenOpt::Less :
+        level == 2 ? llvm::CodeGenOpt::Default : llvm::CodeGenOpt::Aggressive);
+
+    llvm::Expected<std::unique_ptr<llvm::TargetMachine>> target =
+        builder->createTargetMachine();
+
+    if (!target)
+    {
+        std::cerr << "Error: " << llvm::toString(target.takeError())
+            << std::endl;
+        return nullptr;
+    }
+
+    // LLVM only warns about a CPU it doesn't know, and then uses the
+    // generic one
+    if (!cpu.empty() && cpu != "native" &&
+        !(*target)->getMCSubtargetInfo()->isCPUStringValid(cpu))
+    {
+        std::cerr << "Error: unknown CPU " << cpu << std::endl;
+        return nullptr;
+    }
+
+    return std::move(*target);
+}
@@ -0,0 +1,53 @@
+/*
+ * WwuLang Compiler
+ *
+ * Running LLVM's optimization passes over the compiled code
+ *
+ * References:
+ *
+ * Example used for adding optimization passes
+ * http://llvm.org/docs/tutorial/LangImpl4.html
+ */
+
+#ifndef WWULANG_OPTIMIZER_H
+#define WWULANG_OPTIMIZER_H
+
+#include <memory>
+#include <string>
+
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+
+// Optimize every function in the module in place. The levels are like those
+// of other compilers:
+//
+//  0 - do nothing, so the IR corresponds directly with the source
+//  1 - the basic cleanups: promote the variables' memory to registers,
+//      combine instructions, reassociate, remove redundant expressions,
+//      and simplify the control flow
+//  2, 3 - LLVM's standard -O2 and -O3 pipelines
+//
+// If given the target, the passes know e.g. how wide the vector registers
+// are, which the loop vectorizer needs.
+void optimizeModule(llvm::Module& module, unsigned int level,
+    llvm::TargetMachine* target = nullptr);
+
+// Register LLVM's target for the CPU we're running on, which both the JIT
+// and the target machines need. Only the first call does anything, so it
+// can be called from any number of threads at once.
+void initializeNativeTarget();
+
+// A target machine for the CPU we're running on, with all of its features
+// (e.g. AVX2) enabled, like -march=native. Returns null (after outputting
+// an error) if LLVM doesn't support this CPU.
+std::unique_ptr<llvm::TargetMachine> createHostTargetMachine(
+    unsigned int level);
+
+// The same, but for the given CPU of the same architecture, e.g. "haswell",
+// or "native" for the one we're running on. With no CPU only the features
+// every CPU of the architecture has are used, so the code runs anywhere.
+// The code is position independent, so it can go in a shared library.
+std::unique_ptr<llvm::TargetMachine> createTargetMachine(unsigned int level,
+    const std::string& cpu);
+
+#endif
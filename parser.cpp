@@ -0,0 +1,604 @@
+/*
+ * WwuLang Compiler
+ *
+ * A hand-written lexer and recursive descent parser, a faster alternative to
+ * the Spirit grammar that produces the same AST
+ */
+
+#include "parser.h"
+
+#include <deque>
+
+// Only for reading numbers, so that we get exactly the same float value
+// (and accept the same formats, e.g. "1.", ".5", "1e3", "inf") as the
+// grammar's float_ does
+#include <boost/spirit/include/qi_parse.hpp>
+#include <boost/spirit/include/qi_real.hpp>
+
+namespace client
+{
+    namespace
+    {
+        // Splits the input into tokens as the parser asks for them. Whether
+        // something like "5" or "inf" is a number or a variable name depends
+        // on where it is in the grammar, so the parser says what it expects.
+        class lexer
+        {
+        public:
+            lexer(const char* first, const char* last)
+                : pos(first), last(last)
+            {
+            }
+
+            // Skip whitespace, like ascii::space does
+            void skip()
+            {
+                while (pos != last && isSpace(*pos))
+                    ++pos;
+            }
+
+            // The next character after whitespace, or 0 at the end
+            char peek()
+            {
+                skip();
+                return pos != last ? *pos : 0;
+            }
+
+            // Consume the next character if it is c
+            bool accept(char c)
+            {
+                if (peek() != c)
+                    return false;
+
+                ++pos;
+                return true;
+            }
+
+            // A variable name is one or more alphanumeric characters
+            bool variable(const char*& begin, const char*& end)
+            {
+                skip();
+                begin = pos;
+
+                while (pos != last && isAlnum(*pos))
+                    ++pos;
+
+                end = pos;
+                return begin != end;
+            }
+
+            bool number(float& n)
+            {
+                skip();
+                return boost::spirit::qi::parse(pos, last,
+                    boost::spirit::qi::float_, n);
+            }
+
+            const char* pos;
+            const char* last;
+
+        private:
+            // Not the <cctype> versions since those depend on the locale
+            static bool isSpace(char c)
+            {
+                return c == ' ' || (c >= '\t' && c <= '\r');
+            }
+
+            static bool isAlnum(char c)
+            {
+                return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                    (c >= 'A' && c <= 'Z');
+            }
+        };
+
+        // Builds the AST out of what the parser found. The parser is the
+        // same for both kinds of AST, it's only what it builds that changes.
+        //
+        // A chain is a part followed by operators and more parts, i.e. an
+        // expression or a term. The parser opens a part of a chain before
+        // parsing it, and then closes it, or cancels it if it turns out not
+        // to be there after all. first is whether it's the first part of
+        // the chain, otherwise op is the operator before it.
+        struct tree_builder
+        {
+            typedef ast::program program;
+            typedef ast::expression* chain;
+
+            // Each part is created where it goes before it's parsed and
+            // then filled in, since moving a variant holding a
+            // recursive_wrapper moves the whole subtree one node at a time
+            static ast::operand& slot(chain x, bool first, char op)
+            {
+                if (first)
+                {
+                    x->rest.clear();
+                    return x->first;
+                }
+
+                x->rest.emplace_back();
+                x->rest.back().operator_ = op;
+                return x->rest.back().operand_;
+            }
+
+            // The chain for a whole line, which is reused for each one
+            chain top()
+            {
+                line.rest.clear();
+                return &line;
+            }
+
+            // A term is an expression, but the grammar stores it as an
+            // operand when it's the part of a bigger expression, as is an
+            // expression in parenthesis when it's part of a term
+            chain open(chain x, bool first, char op)
+            {
+                ast::operand& part = slot(x, first, op);
+                part = ast::expression();
+                return &boost::get<ast::expression>(part);
+            }
+
+            void close(chain, bool, char, chain) { }
+
+            void cancel(chain x, bool first)
+            {
+                if (!first)
+                    x->rest.pop_back();
+            }
+
+            void number(chain x, bool first, char op, float n)
+            {
+                slot(x, first, op) = n;
+            }
+
+            void variable(chain x, bool first, char op, const char* begin,
+                const char* end)
+            {
+                slot(x, first, op) = std::string(begin, end);
+            }
+
+            // This moves the line into the program, which is only as slow
+            // as the line is deeply nested
+            void assignment(program& x, const char* begin, const char* end,
+                chain expression)
+            {
+                x.push_back(ast::assignment());
+                ast::assignment& a = boost::get<ast::assignment>(x.back());
+                a.variable.assign(begin, end);
+                a.expression_ = std::move(*expression);
+            }
+
+            void expression(program& x, chain expression)
+            {
+                x.push_back(std::move(*expression));
+            }
+
+            ast::expression line;
+        };
+
+        // Everything is a node index, and each operator becomes a node
+        // combining what we have so far with the next part, so nothing
+        // happens until a part is closed
+        struct flat_builder
+        {
+            typedef flat::program program;
+            typedef flat::index chain;
+
+            explicit flat_builder(flat::program& p) : p(p) { }
+
+            chain top() { return 0; }
+
+            chain open(chain, bool, char) { return 0; }
+
+            void close(chain& x, bool first, char op, chain next)
+            {
+                if (first)
+                {
+                    x = next;
+                    return;
+                }
+
+                flat::node n;
+                n.kind = flat::node::operation;
+                n.operator_ = op;
+                n.lhs = x;
+                n.rhs = next;
+                x = p.add(n);
+            }
+
+            void cancel(chain, bool) { }
+
+            void number(chain& x, bool first, char op, float value)
+            {
+                flat::node n;
+                n.kind = flat::node::number;
+                n.operator_ = 0;
+                n.value = value;
+                n.rhs = 0;
+                close(x, first, op, p.add(n));
+            }
+
+            void variable(chain& x, bool first, char op, const char* begin,
+                const char* end)
+            {
+                flat::node n;
+                n.kind = flat::node::variable;
+                n.operator_ = 0;
+                n.name = p.symbols.intern(llvm::StringRef(begin, end - begin));
+                n.rhs = 0;
+                close(x, first, op, p.add(n));
+            }
+
+            void assignment(program& x, const char* begin, const char* end,
+                chain expression)
+            {
+                flat::line l;
+                l.variable = x.symbols.intern(llvm::StringRef(begin, end - begin));
+                l.root = expression;
+                x.lines.push_back(l);
+            }
+
+            void expression(program& x, chain expression)
+            {
+                flat::line l;
+                l.variable = flat::no_symbol;
+                l.root = expression;
+                x.lines.push_back(l);
+            }
+
+            flat::program& p;
+        };
+
+        // One function per rule of the grammar, other than the rules for
+        // expressions, which nest. Each returns whether it matched, and if
+        // it didn't, leaves the lexer where it was.
+        template <typename Builder>
+        class parser
+        {
+            typedef typename Builder::chain chain;
+
+        public:
+            parser(const char* first, const char* last, Builder build)
+                : lex(first, last), build(build)
+            {
+            }
+
+            // program = (program_line % ';') >> -lit_(";")
+            bool program(typename Builder::program& x)
+            {
+                if (!program_line(x))
+                    return false;
+
+                while (true)
+                {
+                    const char* start = lex.pos;
+
+                    if (!lex.accept(';'))
+                        break;
+
+                    if (!program_line(x))
+                    {
+                        // Let the optional trailing ';' have it
+                        lex.pos = start;
+                        break;
+                    }
+                }
+
+                lex.accept(';');
+
+                // Like phrase_parse, skip whitespace after a successful parse
+                lex.skip();
+                return true;
+            }
+
+            // program_line = assignment | expression
+            bool program_line(typename Builder::program& x)
+            {
+                const char* start = lex.pos;
+
+                // Only an assignment if the variable is followed by '='
+                const char* begin;
+                const char* end;
+                chain e;
+
+                if (lex.variable(begin, end) && lex.accept('='))
+                {
+                    if (expression(e))
+                    {
+                        build.assignment(x, begin, end, e);
+                        return true;
+                    }
+                }
+
+                lex.pos = start;
+
+                if (!expression(e))
+                    return false;
+
+                build.expression(x, e);
+                return true;
+            }
+
+            // expression = term >> *(char_('+') >> term | char_('-') >> term)
+            // term = factor >> *(char_('*') >> factor | char_('/') >> factor)
+            // factor = '(' >> expression >> ')' | float_ | variable
+            //
+            // Rather than a function for each that calls the others, which
+            // would use stack for every level of parentheses, this is a loop
+            // that keeps track of where it is in each level itself. Moving
+            // from one state to the next is like one of the functions
+            // returning or calling another.
+            bool expression(chain& x)
+            {
+                enum
+                {
+                    need_factor,
+                    have_factor,
+                    factor_failed,
+                    have_term,
+                    term_failed,
+                    have_expression,
+                    expression_failed
+                } state = need_factor;
+
+                // The top level, which isn't in any parentheses
+                depth = 0;
+                enter(nullptr, build.top());
+
+                while (true)
+                {
+                    level& current = levels[depth - 1];
+
+                    switch (state)
+                    {
+                        case need_factor:
+                        {
+                            if (!current.inTerm && !current.termOpen)
+                            {
+                                current.term = build.open(current.expression,
+                                    !current.inExpression, current.expressionOp);
+                                current.termOpen = true;
+                            }
+
+                            const char* start = lex.pos;
+                            float n;
+                            const char* begin;
+                            const char* end;
+
+                            if (lex.accept('('))
+                            {
+                                enter(start, build.open(current.term,
+                                    !current.inTerm, current.termOp));
+                            }
+                            else if (lex.number(n))
+                            {
+                                build.number(current.term, !current.inTerm,
+                                    current.termOp, n);
+                                state = have_factor;
+                            }
+                            else if (lex.variable(begin, end))
+                            {
+                                build.variable(current.term, !current.inTerm,
+                                    current.termOp, begin, end);
+                                state = have_factor;
+                            }
+                            else
+                            {
+                                lex.pos = start;
+                                state = factor_failed;
+                            }
+                            break;
+                        }
+
+                        case have_factor:
+                            current.inTerm = true;
+                            current.termOpStart = lex.pos;
+                            state = next(current.termOp, '*', '/') ?
+                                need_factor : have_term;
+                            break;
+
+                        // After an operator, the operator isn't part of the
+                        // term after all. Otherwise there's no term.
+                        case factor_failed:
+                            if (current.inTerm)
+                            {
+                                lex.pos = current.termOpStart;
+                                state = have_term;
+                            }
+                            else
+                            {
+                                build.cancel(current.expression,
+                                    !current.inExpression);
+                                current.termOpen = false;
+                                state = term_failed;
+                            }
+                            break;
+
+                        case have_term:
+                            build.close(current.expression,
+                                !current.inExpression, current.expressionOp,
+                                current.term);
+                            current.inTerm = false;
+                            current.termOpen = false;
+                            current.inExpression = true;
+                            current.expressionOpStart = lex.pos;
+                            state = next(current.expressionOp, '+', '-') ?
+                                need_factor : have_expression;
+                            break;
+
+                        case term_failed:
+                            if (current.inExpression)
+                            {
+                                lex.pos = current.expressionOpStart;
+                                state = have_expression;
+                            }
+                            else
+                            {
+                                state = expression_failed;
+                            }
+                            break;
+
+                        // Either we're done, or it's the inside of a factor
+                        // in parentheses
+                        case have_expression:
+                        {
+                            if (depth == 1)
+                            {
+                                x = current.expression;
+                                return true;
+                            }
+
+                            level& outer = levels[depth - 2];
+
+                            if (lex.accept(')'))
+                            {
+                                build.close(outer.term, !outer.inTerm,
+                                    outer.termOp, current.expression);
+                                state = have_factor;
+                            }
+                            else
+                            {
+                                lex.pos = current.start;
+                                build.cancel(outer.term, !outer.inTerm);
+                                state = factor_failed;
+                            }
+
+                            --depth;
+                            break;
+                        }
+
+                        case expression_failed:
+                            if (depth == 1)
+                                return false;
+
+                            lex.pos = current.start;
+                            build.cancel(levels[depth - 2].term,
+                                !levels[depth - 2].inTerm);
+                            state = factor_failed;
+                            --depth;
+                            break;
+                    }
+                }
+            }
+
+            lexer lex;
+
+        private:
+            // Where we are in the expression inside one level of
+            // parentheses: the expression so far, the term so far, and the
+            // operator before the next part of each, which we go back to if
+            // there turns out not to be a next part
+            struct level
+            {
+                // Where the '(' was, or null at the top level
+                const char* start;
+
+                chain expression;
+                bool inExpression;
+                char expressionOp;
+                const char* expressionOpStart;
+
+                // Whether the next term has been opened yet
+                chain term;
+                bool termOpen;
+                bool inTerm;
+                char termOp;
+                const char* termOpStart;
+            };
+
+            // Go into another level of parentheses, reusing the level from
+            // last time if there was one
+            void enter(const char* start, chain expression)
+            {
+                if (depth == levels.size())
+                    levels.emplace_back();
+
+                level& l = levels[depth++];
+                l.start = start;
+                l.expression = expression;
+                l.inExpression = false;
+                l.termOpen = false;
+                l.inTerm = false;
+            }
+
+            // Consume the next operator if it's one of these two
+            bool next(char& op, char op1, char op2)
+            {
+                char c = lex.peek();
+
+                if (c != op1 && c != op2)
+                    return false;
+
+                op = c;
+                ++lex.pos;
+                return true;
+            }
+
+            Builder build;
+
+            // One for each level of parentheses we're in. A deque so that
+            // adding more doesn't move the ones we have.
+            std::deque<level> levels;
+            std::size_t depth = 0;
+        };
+
+        template <typename Builder>
+        bool parse(const char*& first, const char* last,
+            typename Builder::program& program, Builder build)
+        {
+            parser<Builder> p(first, last, build);
+
+            if (!p.program(program))
+                return false;
+
+            first = p.lex.pos;
+            return true;
+        }
+    }
+
+    bool parse_fast(const char*& first, const char* last, ast::program& program)
+    {
+        return parse(first, last, program, tree_builder());
+    }
+
+    bool parse_fast(const char*& first, const char* last, flat::program& program)
+    {
+        return parse(first, last, program, flat_builder(program));
+    }
+
+    bool checkLimits(const char* first, const char* last,
+        const parse_limits& limits, std::string& error)
+    {
+        std::size_t length = last - first;
+
+        if (limits.maxLength && length > limits.maxLength)
+        {
+            error = "Program is " + std::to_string(length) +
+                " characters, more than the limit of " +
+                std::to_string(limits.maxLength);
+            return false;
+        }
+
+        if (!limits.maxDepth)
+            return true;
+
+        // Unbalanced parenthesis are the parser's problem, we only care how
+        // deep they get
+        std::size_t depth = 0;
+
+        for (const char* p = first; p != last; ++p)
+        {
+            if (*p == '(' && ++depth > limits.maxDepth)
+            {
+                error = "Parenthesis nested more than " +
+                    std::to_string(limits.maxDepth) + " deep";
+                return false;
+            }
+            else if (*p == ')' && depth)
+            {
+                --depth;
+            }
+        }
+
+        return true;
+    }
+}
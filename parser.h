@@ -0,0 +1,57 @@
+/*
+ * WwuLang Compiler
+ *
+ * A hand-written lexer and recursive descent parser, a faster alternative to
+ * the Spirit grammar that produces the same AST
+ */
+
+#ifndef WWULANG_PARSER_H
+#define WWULANG_PARSER_H
+
+#include <cstddef>
+#include <string>
+
+#include "ast.h"
+#include "flat_ast.h"
+
+namespace client
+{
+    // Parse [first, last) into the program. This accepts exactly what
+    // phrase_parse() does with the calculator grammar and a space skipper:
+    // it returns whether any program was parsed, and first is left where
+    // parsing stopped, so the whole input was valid if first == last.
+    //
+    // Rather than trying an assignment and then backtracking to re-parse
+    // the line as an expression, it looks ahead for the '=' after the
+    // variable name. It only backtracks when the input is invalid.
+    bool parse_fast(const char*& first, const char* last, ast::program& program);
+
+    // The same, but building the compact AST, which is added to the end of
+    // the program. Variable names go in the program's symbol table.
+    bool parse_fast(const char*& first, const char* last, flat::program& program);
+
+    // Hard limits on what we'll try to compile, so a huge or pathologically
+    // nested program from somewhere we don't trust fails cleanly rather than
+    // using up all the memory. Zero means no limit.
+    struct parse_limits
+    {
+        // How deeply parenthesis can be nested
+        std::size_t maxDepth = 0;
+
+        // How many characters a program can be
+        std::size_t maxLength = 0;
+    };
+
+    // The fast parser and the compact AST keep their own stacks, so they can
+    // handle any depth. Spirit and everything using the tree AST (printing,
+    // compiling, even destroying it) recurse, using native stack for each
+    // level, so they're limited to this much nesting.
+    const std::size_t TreeMaxDepth = 2000;
+
+    // Check [first, last) against the limits without parsing it, which only
+    // takes one pass. Returns false with the reason in error if it's over.
+    bool checkLimits(const char* first, const char* last,
+        const parse_limits& limits, std::string& error);
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * WwuLang Compiler
+ *
+ * Recording which values a program is called with
+ */
+
+#include "profile.h"
+
+#include <cstring>
+
+namespace client
+{
+    std::map<std::string, double> stableValues(const value_profile& profile,
+        const std::vector<std::string>& params, double share)
+    {
+        std::map<std::string, double> values;
+        double calls = static_cast<double>(
+            profile.calls.load(std::memory_order_relaxed));
+
+        if (calls == 0)
+            return values;
+
+        for (std::size_t i = 0; i < params.size() &&
+                i < profile.values.size(); ++i)
+        {
+            const value_profile::entry& e = profile.values[i];
+
+            // If a value is there for a share s of the calls, its lead is at
+            // least s - (1 - s) of them
+            if (e.lead.load(std::memory_order_relaxed) < (2 * share - 1) * calls)
+                continue;
+
+            std::uint64_t bits = e.bits.load(std::memory_order_relaxed);
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            values[params[i]] = value;
+        }
+
+        return values;
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * WwuLang Compiler
+ *
+ * Recording which values a program is called with, so it can be compiled
+ * again for the ones that hardly ever change
+ */
+
+#ifndef WWULANG_PROFILE_H
+#define WWULANG_PROFILE_H
+
+#include <map>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace client
+{
+    // The code reads and writes these directly as 64-bit integers
+    static_assert(sizeof(std::atomic<std::uint64_t>) == sizeof(std::uint64_t),
+        "atomics have to be plain integers");
+
+    // What the arguments of a program have been, kept by its own code when
+    // it's compiled with CompilerContext::Profile. For each parameter this
+    // is a majority vote: the value it's had most often, and how many more
+    // times that's been than any other value. A value that's there for all
+    // but a few calls ends up with a lead of nearly the number of calls,
+    // and one that keeps changing with a lead of about nothing. The code
+    // doesn't lock anything, so when it's called on many threads at once
+    // the odd call can be missed, which doesn't matter for a profile.
+    struct value_profile
+    {
+        explicit value_profile(std::size_t params) : calls(0), values(params)
+        {
+        }
+
+        struct entry
+        {
+            entry() : bits(0), lead(0) { }
+
+            // The value as bits, so -0 and NaNs are told apart
+            std::atomic<std::uint64_t> bits;
+            std::atomic<std::uint64_t> lead;
+        };
+
+        std::atomic<std::uint64_t> calls;
+        std::vector<entry> values;
+    };
+
+    // The parameters whose value was the same in at least about the given
+    // share of the calls (e.g. 0.95), with that value
+    std::map<std::string, double> stableValues(const value_profile& profile,
+        const std::vector<std::string>& params, double share);
+}
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * WwuLang Compiler
+ *
+ * A long-running compile server on a Unix socket
+ */
+
+#include "server.h"
+
+#include <set>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <condition_variable>
+
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+namespace client
+{
+    namespace
+    {
+        // How long a worker gives a client to send the whole of a request,
+        // or to take the whole of the response, before dropping the
+        // connection. Workers only start reading once there's something to
+        // read, so this only matters for a client that stops or trickles
+        // partway through, which would otherwise keep the worker to itself
+        // for as long as it liked.
+        const int IOTimeoutMs = 10000;
+
+        typedef std::chrono::steady_clock::time_point time_point;
+
+        // Whether a failed recv() or send() should just be tried again. With
+        // a deadline they don't block, so the socket may not be ready yet.
+        bool retry(const time_point* deadline)
+        {
+            return errno == EINTR ||
+                (deadline && (errno == EAGAIN || errno == EWOULDBLOCK));
+        }
+
+        // When the whole message has to have gone through by, or null for
+        // no timeout
+        const time_point* deadlineAfter(int timeoutMs, time_point& end)
+        {
+            end = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(timeoutMs);
+            return timeoutMs >= 0 ? &end : nullptr;
+        }
+
+        // The signal handler writes to this to wake up the loop accepting
+        // connections, since it can't do anything else safely
+        int stopPipe[2] = { -1, -1 };
+
+        void requestStop(int)
+        {
+            char c = 0;
+            ssize_t written = write(stopPipe[1], &c, 1);
+            (void)written;
+        }
+
+        // Wait until the socket is ready for events, or return false if
+        // the deadline passes first. Without a deadline there's nothing to
+        // wait for, since the socket blocks.
+        bool waitFor(int fd, short events, const time_point* deadline)
+        {
+            while (deadline)
+            {
+                std::chrono::milliseconds left =
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        *deadline - std::chrono::steady_clock::now());
+
+                if (left.count() <= 0)
+                    return false;
+
+                pollfd p = { fd, events, 0 };
+                int ready = poll(&p, 1, static_cast<int>(left.count()));
+
+                if (ready > 0)
+                    return true;
+
+                if (ready == 0 || errno != EINTR)
+                    return false;
+            }
+
+            return true;
+        }
+
+        // With a deadline the socket is only used once it's ready, without
+        // blocking, so no one call can wait past it
+        bool readAll(int fd, char* data, std::size_t size,
+            const time_point* deadline)
+        {
+            while (size > 0)
+            {
+                if (!waitFor(fd, POLLIN, deadline))
+                    return false;
+
+                ssize_t n = recv(fd, data, size, deadline ? MSG_DONTWAIT : 0);
+
+                if (n < 0 && retry(deadline))
+                    continue;
+
+                if (n <= 0)
+                    return false;
+
+                data += n;
+                size -= n;
+            }
+
+            return true;
+        }
+
+        bool writeAll(int fd, const char* data, std::size_t size,
+            const time_point* deadline)
+        {
+            while (size > 0)
+            {
+                if (!waitFor(fd, POLLOUT, deadline))
+                    return false;
+
+                // Without a SIGPIPE if the other end has gone
+                ssize_t n = send(fd, data, size,
+                    MSG_NOSIGNAL | (deadline ? MSG_DONTWAIT : 0));
+
+                if (n < 0 && retry(deadline))
+                    continue;
+
+                if (n <= 0)
+                    return false;
+
+                data += n;
+                size -= n;
+            }
+
+            return true;
+        }
+
+        // Fill in the address, or return false if the path is too long
+        bool socketAddress(const std::string& path, sockaddr_un& address)
+        {
+            std::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+
+            if (path.size() >= sizeof(address.sun_path))
+            {
+                std::cerr << "Error: socket path is too long: " << path
+                    << std::endl;
+                return false;
+            }
+
+            std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+            return true;
+        }
+    }
+
+    bool readMessage(int fd, std::string& message, int timeoutMs)
+    {
+        time_point end;
+        const time_point* deadline = deadlineAfter(timeoutMs, end);
+        unsigned char header[4];
+
+        if (!readAll(fd, reinterpret_cast<char*>(header), sizeof(header),
+                deadline))
+            return false;
+
+        std::uint32_t size = header[0] | header[1] << 8 | header[2] << 16 |
+            static_cast<std::uint32_t>(header[3]) << 24;
+
+        if (size > MaxMessageSize)
+            return false;
+
+        message.resize(size);
+        return readAll(fd, &message[0], size, deadline);
+    }
+
+    bool writeMessage(int fd, llvm::StringRef message, int timeoutMs)
+    {
+        if (message.size() > MaxMessageSize)
+            return false;
+
+        time_point end;
+        const time_point* deadline = deadlineAfter(timeoutMs, end);
+
+        std::uint32_t size = message.size();
+        unsigned char header[4] = {
+            static_cast<unsigned char>(size),
+            static_cast<unsigned char>(size >> 8),
+            static_cast<unsigned char>(size >> 16),
+            static_cast<unsigned char>(size >> 24)
+        };
+
+        return writeAll(fd, reinterpret_cast<char*>(header), sizeof(header),
+                deadline) &&
+            writeAll(fd, message.data(), message.size(), deadline);
+    }
+
+    bool serve(const std::string& path, unsigned int threads,
+        const std::function<request_handler()>& createHandler)
+    {
+        sockaddr_un address;
+
+        if (!socketAddress(path, address))
+            return false;
+
+        // Only replace an old socket, e.g. from a server that was killed,
+        // not some other file
+        struct stat existing;
+
+        if (lstat(path.c_str(), &existing) == 0)
+        {
+            if (!S_ISSOCK(existing.st_mode))
+            {
+                std::cerr << "Error: " << path << " exists and isn't a socket"
+                    << std::endl;
+                return false;
+            }
+
+            unlink(path.c_str());
+        }
+
+        // Workers write to wakePipe when they're done with a connection, so
+        // we start watching it again
+        int wakePipe[2];
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (listener < 0 ||
+            bind(listener, reinterpret_cast<sockaddr*>(&address),
+                sizeof(address)) != 0 ||
+            listen(listener, SOMAXCONN) != 0 ||
+            pipe(stopPipe) != 0 || pipe(wakePipe) != 0)
+        {
+            std::cerr << "Error: could not listen on " << path << ": "
+                << std::strerror(errno) << std::endl;
+
+            if (listener >= 0)
+                close(listener);
+
+            return false;
+        }
+
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_handler = requestStop;
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+
+        // Guards everything below
+        std::mutex mutex;
+        std::condition_variable ready;
+
+        // Connections with a request waiting for a worker, the ones waiting
+        // for the client to send the next request, and every open one
+        std::deque<int> waiting;
+        std::set<int> idle;
+        std::set<int> open;
+        bool stopping = false;
+
+        // Whenever a connection has a request, the next free worker answers
+        // it, so a client sending one request after another doesn't keep
+        // that worker to itself
+        auto worker = [&]()
+        {
+            request_handler handle = createHandler();
+            std::string request;
+            std::string response;
+
+            while (true)
+            {
+                int fd;
+
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [&]() {
+                        return stopping || !waiting.empty();
+                    });
+
+                    if (stopping)
+                        return;
+
+                    fd = waiting.front();
+                    waiting.pop_front();
+                }
+
+                bool answered = readMessage(fd, request, IOTimeoutMs);
+
+                if (answered)
+                {
+                    response.clear();
+                    handle(request, response);
+                    answered = writeMessage(fd, response, IOTimeoutMs);
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+
+                // Otherwise the client has gone, or timed out
+                if (answered)
+                {
+                    idle.insert(fd);
+                }
+                else
+                {
+                    open.erase(fd);
+                    close(fd);
+                }
+
+                char c = 0;
+                ssize_t written = write(wakePipe[1], &c, 1);
+                (void)written;
+            }
+        };
+
+        std::vector<std::thread> workers;
+
+        for (unsigned int i = 0; i < threads; ++i)
+            workers.emplace_back(worker);
+
+        std::cerr << "Listening on " << path << " with " << threads
+            << " workers" << std::endl;
+
+        std::vector<pollfd> fds;
+
+        while (true)
+        {
+            fds.clear();
+            fds.push_back({ stopPipe[0], POLLIN, 0 });
+            fds.push_back({ wakePipe[0], POLLIN, 0 });
+            fds.push_back({ listener, POLLIN, 0 });
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                for (int fd : idle)
+                    fds.push_back({ fd, POLLIN, 0 });
+            }
+
+            if (poll(fds.data(), fds.size(), -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                std::cerr << "Error: " << std::strerror(errno) << std::endl;
+                break;
+            }
+
+            if (fds[0].revents)
+                break;
+
+            if (fds[1].revents)
+            {
+                char buffer[64];
+                ssize_t r = read(wakePipe[0], buffer, sizeof(buffer));
+                (void)r;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (fds[2].revents)
+            {
+                int fd = accept(listener, nullptr, nullptr);
+
+                if (fd >= 0)
+                {
+                    idle.insert(fd);
+                    open.insert(fd);
+                }
+            }
+
+            // Hand the ones with something to read to the workers, which
+            // includes the ones that have been closed
+            for (std::size_t i = 3; i < fds.size(); ++i)
+            {
+                if (fds[i].revents)
+                {
+                    idle.erase(fds[i].fd);
+                    waiting.push_back(fds[i].fd);
+                    ready.notify_one();
+                }
+            }
+        }
+
+        // Stop taking new connections, and wake up any workers waiting on
+        // a client
+        close(listener);
+        unlink(path.c_str());
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+
+            for (int fd : open)
+                shutdown(fd, SHUT_RDWR);
+
+            ready.notify_all();
+        }
+
+        for (std::thread& thread : workers)
+            thread.join();
+
+        for (int fd : open)
+            close(fd);
+
+        close(stopPipe[0]);
+        close(stopPipe[1]);
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+        return true;
+    }
+
+    int connectTo(const std::string& path)
+    {
+        sockaddr_un address;
+
+        if (!socketAddress(path, address))
+            return -1;
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address),
+                sizeof(address)) != 0)
+        {
+            std::cerr << "Error: could not connect to " << path << ": "
+                << std::strerror(errno) << std::endl;
+
+            if (fd >= 0)
+                close(fd);
+
+            return -1;
+        }
+
+        return fd;
+    }
+}
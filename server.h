@@ -0,0 +1,55 @@
+/*
+ * WwuLang Compiler
+ *
+ * A long-running compile server on a Unix socket, so we only pay for
+ * starting up, building the parser, and setting up LLVM once rather than
+ * for every program
+ */
+
+#ifndef WWULANG_SERVER_H
+#define WWULANG_SERVER_H
+
+#include <string>
+#include <cstdint>
+#include <functional>
+
+#include <llvm/ADT/StringRef.h>
+
+namespace client
+{
+    // Requests and responses are both sent as a 4 byte little-endian length
+    // followed by that many bytes. Anything longer than this is refused.
+    const std::uint32_t MaxMessageSize = 64 * 1024 * 1024;
+
+    // Read or write one message. Returns false if the other end has gone,
+    // the message is too long, or with a timeout, if the whole message
+    // hasn't gone through within that many milliseconds.
+    bool readMessage(int fd, std::string& message, int timeoutMs = -1);
+    bool writeMessage(int fd, llvm::StringRef message, int timeoutMs = -1);
+
+    // What a worker does with each request, filling in the response
+    typedef std::function<void(const std::string& request,
+        std::string& response)> request_handler;
+
+    // Listen on the socket at path, replacing an old socket if it's there,
+    // and answer requests until we get SIGINT or SIGTERM. Each request is
+    // answered by the next free worker of the pool. A client can have many
+    // connections open for requests at once, but on each connection it
+    // gets the response before sending the next request. A connection
+    // that takes more than a few seconds to send the whole of a request,
+    // or take the whole of a response, is dropped so it doesn't tie up a
+    // worker.
+    //
+    // Each worker calls createHandler once when it starts, on its own
+    // thread, so it can set up anything it keeps between requests, e.g. its
+    // own LLVM context. Returns false (after outputting an error) if the
+    // socket couldn't be set up.
+    bool serve(const std::string& path, unsigned int threads,
+        const std::function<request_handler()>& createHandler);
+
+    // Connect to a server. Returns -1 (after outputting an error) if that
+    // failed.
+    int connectTo(const std::string& path);
+}
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * WwuLang Compiler
+ *
+ * Measuring where the time goes when compiling
+ */
+
+#include "stats.h"
+
+#include <ctime>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+#include <sys/resource.h>
+
+#include <llvm/IR/Instructions.h>
+
+namespace client
+{
+    thread_local std::uint64_t allocatedBytes = 0;
+
+    static const char* const phaseNames[] = {
+        "parse", "simplify", "codegen", "verify", "optimize", "cache", "emit"
+    };
+
+    static const int phaseCount = static_cast<int>(phase::count);
+
+    const char* phaseName(phase p)
+    {
+        return phaseNames[static_cast<int>(p)];
+    }
+
+    std::uint64_t wallTime()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Only counting the time this thread was running
+    static std::uint64_t cpuTime()
+    {
+        timespec t;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+        return static_cast<std::uint64_t>(t.tv_sec) * 1000000000 + t.tv_nsec;
+    }
+
+    stats::stats()
+        : programs(0), astNodes(0), instructions(0), allocas(0), allocated(0)
+    {
+        for (int i = 0; i < phaseCount; ++i)
+            wall[i] = cpu[i] = 0;
+    }
+
+    stats& stats::operator+=(const stats& other)
+    {
+        for (int i = 0; i < phaseCount; ++i)
+        {
+            wall[i] += other.wall[i];
+            cpu[i] += other.cpu[i];
+        }
+
+        programs += other.programs;
+        astNodes += other.astNodes;
+        instructions += other.instructions;
+        allocas += other.allocas;
+        allocated += other.allocated;
+
+        return *this;
+    }
+
+    phase_timer::phase_timer(stats* s, phase p)
+        : s(s), p(p), wallStart(0), cpuStart(0), allocatedStart(0)
+    {
+        if (s)
+        {
+            wallStart = wallTime();
+            cpuStart = cpuTime();
+            allocatedStart = allocatedBytes;
+        }
+    }
+
+    phase_timer::~phase_timer()
+    {
+        if (s)
+        {
+            s->wall[static_cast<int>(p)] += wallTime() - wallStart;
+            s->cpu[static_cast<int>(p)] += cpuTime() - cpuStart;
+            s->allocated += allocatedBytes - allocatedStart;
+        }
+    }
+
+    namespace
+    {
+        // Count the numbers, variables, and operators
+        struct counter
+        {
+            typedef std::uint64_t result_type;
+
+            std::uint64_t operator()(float) const { return 1; }
+            std::uint64_t operator()(const std::string&) const { return 1; }
+
+            std::uint64_t operator()(const ast::expression& x) const
+            {
+                std::uint64_t count = boost::apply_visitor(*this, x.first);
+
+                for (const ast::operation& op : x.rest)
+                    count += 1 + boost::apply_visitor(*this, op.operand_);
+
+                return count;
+            }
+
+            std::uint64_t operator()(const ast::assignment& x) const
+            {
+                return (*this)(x.expression_);
+            }
+        };
+    }
+
+    std::uint64_t countNodes(const ast::program& program)
+    {
+        std::uint64_t count = 0;
+
+        for (const ast::program_line& line : program)
+            count += boost::apply_visitor(counter(), line);
+
+        return count;
+    }
+
+    std::uint64_t countNodes(const flat::program& program)
+    {
+        return program.nodes.size();
+    }
+
+    void countInstructions(stats& s, const llvm::Function& func)
+    {
+        for (const llvm::BasicBlock& block : func)
+        {
+            for (const llvm::Instruction& instruction : block)
+            {
+                ++s.instructions;
+
+                if (llvm::isa<llvm::AllocaInst>(instruction))
+                    ++s.allocas;
+            }
+        }
+    }
+
+    // In kilobytes
+    static long peakRSS()
+    {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    void printStats(std::ostream& out, const stats& s, std::uint64_t elapsed,
+        bool json)
+    {
+        // Milliseconds with a fixed number of digits so it's easy to compare
+        auto ms = [](std::uint64_t ns)
+        {
+            std::ostringstream result;
+            result << std::fixed << std::setprecision(3) << ns / 1e6;
+            return result.str();
+        };
+
+        if (json)
+        {
+            out << "{\"programs\": " << s.programs
+                << ", \"elapsed_ms\": " << ms(elapsed)
+                << ", \"phases\": {";
+
+            for (int i = 0; i < phaseCount; ++i)
+                out << (i ? ", " : "") << "\"" << phaseNames[i]
+                    << "\": {\"wall_ms\": " << ms(s.wall[i])
+                    << ", \"cpu_ms\": " << ms(s.cpu[i]) << "}";
+
+            out << "}, \"ast_nodes\": " << s.astNodes
+                << ", \"instructions\": " << s.instructions
+                << ", \"allocas\": " << s.allocas
+                << ", \"peak_rss_kb\": " << peakRSS()
+                << ", \"allocated_bytes\": " << s.allocated << "}"
+                << std::endl;
+            return;
+        }
+
+        out << "Statistics for " << s.programs << " programs ("
+            << ms(elapsed) << " ms elapsed)" << std::endl
+            << "  phase          wall ms      cpu ms" << std::endl;
+
+        for (int i = 0; i < phaseCount; ++i)
+            out << "  " << std::left << std::setw(9) << phaseNames[i]
+                << std::right << std::setw(12) << ms(s.wall[i])
+                << std::setw(12) << ms(s.cpu[i]) << std::endl;
+
+        out << "  AST nodes:      " << s.astNodes << std::endl
+            << "  Instructions:   " << s.instructions << std::endl
+            << "  Allocas:        " << s.allocas << std::endl
+            << "  Peak RSS:       " << peakRSS() << " KB" << std::endl
+            << "  Allocated:      " << s.allocated << " bytes" << std::endl;
+    }
+}
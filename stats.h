@@ -0,0 +1,95 @@
+/*
+ * WwuLang Compiler
+ *
+ * Measuring where the time goes when compiling
+ */
+
+#ifndef WWULANG_STATS_H
+#define WWULANG_STATS_H
+
+#include <cstdint>
+#include <iostream>
+
+#include <llvm/IR/Function.h>
+
+#include "ast.h"
+#include "flat_ast.h"
+
+namespace client
+{
+    // What we time separately
+    enum class phase
+    {
+        parse,
+        // Optimizing the AST, see optimizeAST()
+        simplify,
+        codegen,
+        // Finishing off the function and verifying it
+        verify,
+        optimize,
+        cache,
+        // Outputting the code or running it in the JIT
+        emit,
+        count
+    };
+
+    // What the phase is called in the output, e.g. "parse"
+    const char* phaseName(phase p);
+
+    // Bytes allocated with new on this thread so far. The compiler counts
+    // these by replacing operator new, otherwise this stays zero.
+    extern thread_local std::uint64_t allocatedBytes;
+
+    // Counts and times for one or more programs. Each thread should have
+    // its own, and then they can be added together.
+    struct stats
+    {
+        stats();
+
+        stats& operator+=(const stats& other);
+
+        // Nanoseconds spent in each phase
+        std::uint64_t wall[static_cast<int>(phase::count)];
+        std::uint64_t cpu[static_cast<int>(phase::count)];
+
+        std::uint64_t programs;
+        std::uint64_t astNodes;
+        std::uint64_t instructions;
+        std::uint64_t allocas;
+        std::uint64_t allocated;
+    };
+
+    // Adds the time from when it's created until it's destroyed to the
+    // phase. Does nothing if there are no stats.
+    class phase_timer
+    {
+    public:
+        phase_timer(stats* s, phase p);
+        ~phase_timer();
+
+    private:
+        stats* s;
+        phase p;
+        std::uint64_t wallStart;
+        std::uint64_t cpuStart;
+        std::uint64_t allocatedStart;
+    };
+
+    // The number of numbers, variables, and operators in the AST
+    std::uint64_t countNodes(const ast::program& program);
+    std::uint64_t countNodes(const flat::program& program);
+
+    // Count the instructions and allocas in the function as generated
+    void countInstructions(stats& s, const llvm::Function& func);
+
+    // Output the stats as a table or as JSON. Elapsed is the total wall
+    // time in nanoseconds, which for multiple threads is less than the sum
+    // of the phases.
+    void printStats(std::ostream& out, const stats& s, std::uint64_t elapsed,
+        bool json);
+
+    // Nanoseconds on a clock that only goes forward
+    std::uint64_t wallTime();
+}
+
+#endif
@@ -0,0 +1,620 @@
+/*
+ * WwuLang Compiler
+ *
+ * Library interface, for compiling programs from C or C++ and calling them
+ * directly as native functions
+ */
+
+#include "wwulang.h"
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <condition_variable>
+
+#include "ast.h"
+#include "parser.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "ast_optimizer.h"
+#include "interpreter.h"
+#include "profile.h"
+#include "jit.h"
+
+// double <name>_array(const double* args), see createArrayWrapper()
+typedef double (*array_function)(const double*);
+
+struct wwl_program
+{
+    wwl_program()
+        : function(nullptr), array(nullptr), params(0), optLevel(0),
+          optimized(symbols), calls(0), threshold(0), specializeAfter(0),
+          profiling(false), compiling(false), failed(false)
+    {
+    }
+
+    // The native code for wwl_function(), which is replaced once the code
+    // has been profiled, see profiledTracker
+    llvm::orc::ResourceTrackerSP tracker;
+    std::string name;
+    std::atomic<void*> function;
+
+    // The native code for wwl_call(). This is set last, once the rest is,
+    // so until then calls go to the interpreter, and afterwards straight
+    // to the native code.
+    std::atomic<array_function> array;
+    std::size_t params;
+
+    // For a program that's interpreted first: what's needed to compile it
+    // later, the bytecode for the interpreter until then, and how many
+    // times it's been called
+    std::vector<std::string> paramNames;
+    unsigned int optLevel;
+    client::flat::symbol_table symbols;
+    client::flat::program optimized;
+    client::bytecode code;
+    std::atomic<unsigned long> calls;
+    unsigned long threshold;
+
+    // For a program that's specialized later: the profile its native code
+    // keeps, how many calls to profile, and whether it's still being
+    // profiled, which whoever queues it to be specialized clears. Once it's
+    // decided what to specialize, the code is compiled again without the
+    // profile, and the code that kept it stays in the JIT until the program
+    // is freed, since wwl_function() may have returned it. The specialized
+    // code is in the JIT separately, since it calls the code without the
+    // profile when the arguments aren't what it was specialized for.
+    std::unique_ptr<client::value_profile> profile;
+    unsigned long specializeAfter;
+    std::atomic<bool> profiling;
+    llvm::orc::ResourceTrackerSP profiledTracker;
+    llvm::orc::ResourceTrackerSP specializedTracker;
+
+    // Guards compiling or specializing later, which only one thread does. Anyone else that
+    // needs the native code waits until it's done. If compiling failed, the
+    // reason is kept for wwl_function() to pass on to its caller, since it
+    // may have been compiled on another thread.
+    std::mutex mutex;
+    std::condition_variable done;
+    bool compiling;
+    bool failed;
+    std::string error;
+};
+
+namespace
+{
+    // Every program is compiled into the same JIT, which is only created
+    // when the first one is
+    client::jit* sharedJIT()
+    {
+        static std::once_flag once;
+        static std::unique_ptr<client::jit> jit;
+
+        std::call_once(once, []() { jit = client::jit::create(); });
+        return jit.get();
+    }
+
+    // Programs all go in the same JIT, so their functions need different
+    // names
+    std::string uniqueName()
+    {
+        static std::atomic<unsigned long> next(0);
+        return "wwl_program_" + std::to_string(next++);
+    }
+
+    thread_local std::string lastError;
+
+    // How often a parameter has to have the same value to be specialized
+    const double StableShare = 0.95;
+
+    wwl_program* fail(const std::string& error)
+    {
+        lastError = error;
+        return nullptr;
+    }
+
+    // Add double <name>_array(const double* args), which calls the function
+    // with the arguments from the array
+    void createArrayWrapper(CompilerContext& ctx, llvm::Function* func)
+    {
+        llvm::LLVMContext& context = *ctx.TheContext;
+        llvm::Type* doubleType = llvm::Type::getDoubleTy(context);
+        llvm::Type* arrayType = llvm::PointerType::get(doubleType, 0);
+
+        llvm::Function* wrapper = llvm::Function::Create(
+            llvm::FunctionType::get(doubleType, { arrayType }, false),
+            llvm::Function::ExternalLinkage, func->getName() + "_array",
+            ctx.TheModule.get());
+
+        llvm::BasicBlock* entry = llvm::BasicBlock::Create(context, "entry",
+            wrapper);
+        ctx.Builder->SetInsertPoint(entry);
+
+        std::vector<llvm::Value*> args;
+
+        for (std::size_t i = 0; i < func->arg_size(); ++i)
+            args.push_back(ctx.Builder->CreateLoad(doubleType,
+                ctx.Builder->CreateConstInBoundsGEP1_64(doubleType,
+                    wrapper->getArg(0), i)));
+
+        ctx.Builder->CreateRet(ctx.Builder->CreateCall(func, args));
+    }
+
+    // Optimize the module and add it to the shared JIT, returning the array
+    // wrapper of the function called name, and the tracker to remove it
+    // with. Returns null with the reason in error if it failed.
+    array_function addToJIT(CompilerContext& ctx, const std::string& name,
+        llvm::orc::ResourceTrackerSP& tracker, std::string& error)
+    {
+        client::jit* jit = sharedJIT();
+
+        optimizeModule(*ctx.TheModule, ctx.OptLevel, ctx.Target.get());
+
+        tracker = jit->add(std::move(ctx.TheModule), std::move(ctx.TheContext));
+
+        if (!tracker)
+        {
+            error = "could not add the program to the JIT";
+            return nullptr;
+        }
+
+        llvm::JITTargetAddress array = jit->lookup(name + "_array");
+
+        if (!array)
+        {
+            llvm::consumeError(tracker->remove());
+            tracker = nullptr;
+            error = "could not compile the program to native code";
+            return nullptr;
+        }
+
+        return reinterpret_cast<array_function>(static_cast<intptr_t>(array));
+    }
+
+    // Compile the program to native code in the shared JIT, filling in the
+    // tracker, name, and function, and returning the array wrapper. With
+    // profile, the code keeps the program's profile if it's to be
+    // specialized later. Returns null with the reason in error if it failed.
+    array_function compileNative(const client::flat::program& ast,
+        const std::vector<std::string>& params, unsigned int optLevel,
+        wwl_program& program, bool profile, std::string& error)
+    {
+        client::jit* jit = sharedJIT();
+
+        // Each compile has its own context, so this works on any number of
+        // threads at once
+        CompilerContext ctx(optLevel > 3 ? 3 : optLevel);
+        ctx.TheModule->setDataLayout(jit->getDataLayout());
+        ctx.Profile = profile ? program.profile.get() : nullptr;
+
+        llvm::Function* mainFunction = createMainPrototype(ctx, params);
+        client::flat::compiler ast_compile(ctx);
+        llvm::Function* func = createMainFunction(ctx, ast_compile(ast),
+            mainFunction);
+
+        if (!func)
+        {
+            error = ctx.Error.empty() ? "failed to compile" : ctx.Error;
+            return nullptr;
+        }
+
+        std::string name = uniqueName();
+        func->setName(name);
+        createArrayWrapper(ctx, func);
+
+        llvm::orc::ResourceTrackerSP tracker;
+        array_function array = addToJIT(ctx, name, tracker, error);
+
+        if (!array)
+            return nullptr;
+
+        llvm::JITTargetAddress function = jit->lookup(name);
+
+        if (!function)
+        {
+            llvm::consumeError(tracker->remove());
+            error = "could not compile the program to native code";
+            return nullptr;
+        }
+
+        program.tracker = tracker;
+        program.name = name;
+        program.function.store(reinterpret_cast<void*>(
+            static_cast<intptr_t>(function)), std::memory_order_release);
+        return array;
+    }
+
+    // Compile the program again with the parameters in values as constants,
+    // behind a guard that calls the code it already has, which no longer
+    // keeps the profile, for any other arguments. Returns the array wrapper for the guard, or null with the
+    // reason in error if it failed.
+    array_function compileSpecialized(wwl_program& program,
+        const std::map<std::string, double>& values, std::string& error)
+    {
+        CompilerContext ctx(program.optLevel > 3 ? 3 : program.optLevel);
+        ctx.TheModule->setDataLayout(sharedJIT()->getDataLayout());
+        ctx.Specialized = values;
+
+        llvm::Function* mainFunction = createMainPrototype(ctx,
+            program.paramNames);
+        client::flat::compiler ast_compile(ctx);
+        llvm::Function* func = createMainFunction(ctx,
+            ast_compile(program.optimized), mainFunction);
+
+        std::string name = program.name + "_specialized";
+        llvm::Function* guard = func ? createGuard(ctx, func, name,
+            program.name, program.paramNames) : nullptr;
+
+        if (!guard)
+        {
+            error = ctx.Error.empty() ? "failed to compile" : ctx.Error;
+            return nullptr;
+        }
+
+        createArrayWrapper(ctx, guard);
+        return addToJIT(ctx, name, program.specializedTracker, error);
+    }
+
+    // Compile an interpreted program now that it's been claimed by setting
+    // compiling, and switch wwl_call() over to the native code. If it
+    // fails, it just keeps being interpreted.
+    void finishCompiling(wwl_program* program)
+    {
+        std::string error;
+        array_function array = compileNative(program->optimized,
+            program->paramNames, program->optLevel, *program, true, error);
+
+        std::lock_guard<std::mutex> lock(program->mutex);
+
+        if (array)
+        {
+            program->array.store(array, std::memory_order_release);
+            program->profiling.store(program->profile != nullptr,
+                std::memory_order_relaxed);
+        }
+        else
+        {
+            program->failed = true;
+            program->error = error;
+        }
+
+        program->compiling = false;
+        program->done.notify_all();
+    }
+
+    // Specialize a native program now that it's been claimed by setting
+    // compiling, and switch wwl_call() and wwl_function() over to the new
+    // code. Either way the profile isn't needed any more, so the code is
+    // first compiled again without it, which is what's used if none of the
+    // parameters keep the same value. If that fails, it just keeps using the
+    // code it has.
+    void finishSpecializing(wwl_program* program)
+    {
+        std::map<std::string, double> values = client::stableValues(
+            *program->profile, program->paramNames, StableShare);
+        llvm::orc::ResourceTrackerSP profiled = program->tracker;
+        std::string error;
+
+        array_function array = compileNative(program->optimized,
+            program->paramNames, program->optLevel, *program, false, error);
+
+        if (array)
+            program->profiledTracker = profiled;
+
+        if (array && !values.empty())
+        {
+            array_function specialized = compileSpecialized(*program, values,
+                error);
+
+            if (specialized)
+                array = specialized;
+        }
+
+        std::lock_guard<std::mutex> lock(program->mutex);
+
+        if (array)
+            program->array.store(array, std::memory_order_release);
+
+        program->compiling = false;
+        program->done.notify_all();
+    }
+
+    // Compiles the programs that have been called enough times on a thread
+    // of its own, one at a time, so the threads calling them never wait
+    class background_compiler
+    {
+    public:
+        background_compiler() : stopping(false)
+        {
+            worker = std::thread([this]() { run(); });
+        }
+
+        ~background_compiler()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+                ready.notify_all();
+            }
+
+            worker.join();
+        }
+
+        // Compile the program unless it's already compiled or being
+        // compiled, or specialize it once it's native
+        void add(wwl_program* program, bool specialize = false)
+        {
+            {
+                std::lock_guard<std::mutex> lock(program->mutex);
+
+                if (program->compiling || program->failed ||
+                    (!specialize &&
+                     program->array.load(std::memory_order_acquire)))
+                    return;
+
+                program->compiling = true;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::make_pair(program, specialize));
+            ready.notify_one();
+        }
+
+        // Take the program off the queue if it's still waiting there, in
+        // which case it's still marked as compiling and the caller has to
+        // either compile it or free it. Otherwise it's either done or being
+        // compiled.
+        bool cancel(wwl_program* program)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (auto it = queue.begin(); it != queue.end(); ++it)
+            {
+                if (it->first == program)
+                {
+                    queue.erase(it);
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+    private:
+        void run()
+        {
+            while (true)
+            {
+                std::pair<wwl_program*, bool> job;
+
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [this]() {
+                        return stopping || !queue.empty();
+                    });
+
+                    if (stopping)
+                        return;
+
+                    job = queue.front();
+                    queue.pop_front();
+                }
+
+                if (job.second)
+                    finishSpecializing(job.first);
+                else
+                    finishCompiling(job.first);
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<std::pair<wwl_program*, bool>> queue;
+        bool stopping;
+        std::thread worker;
+    };
+
+    // Created the first time a program needs it, which is after the JIT
+    // is, so it's destroyed first and never uses the JIT after it's gone
+    background_compiler& backgroundCompiler()
+    {
+        static background_compiler compiler;
+        return compiler;
+    }
+
+    // Wait for an interpreted program to be compiled, compiling it on this
+    // thread if nobody else is
+    void compileNow(wwl_program* program)
+    {
+        if (backgroundCompiler().cancel(program))
+        {
+            finishCompiling(program);
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(program->mutex);
+        program->done.wait(lock, [program]() { return !program->compiling; });
+
+        if (program->failed || program->array.load(std::memory_order_acquire))
+            return;
+
+        program->compiling = true;
+        lock.unlock();
+        finishCompiling(program);
+    }
+}
+
+extern "C"
+{
+    void wwl_default_options(wwl_options* opts)
+    {
+        opts->opt_level = 2;
+        opts->jit_threshold = 0;
+        opts->specialize_after = 0;
+    }
+
+    wwl_program* wwl_compile(const char* source, const char* const* param_names,
+        const wwl_options* opts)
+    {
+        wwl_options defaults;
+        wwl_default_options(&defaults);
+
+        if (!opts)
+            opts = &defaults;
+
+        if (!sharedJIT())
+            return fail("could not create the JIT");
+
+        std::unique_ptr<wwl_program> program(new wwl_program);
+
+        for (const char* const* name = param_names; name && *name; ++name)
+            program->paramNames.push_back(*name);
+
+        program->params = program->paramNames.size();
+        program->optLevel = opts->opt_level;
+        program->threshold = opts->jit_threshold;
+
+        // There's nothing to specialize without parameters
+        if (opts->specialize_after && program->params)
+        {
+            program->specializeAfter = opts->specialize_after;
+            program->profile.reset(new client::value_profile(program->params));
+        }
+
+        // The compact AST, since unlike the tree it can be nested as deeply
+        // as memory allows
+        client::flat::program ast(program->symbols);
+        const char* first = source;
+        const char* last = source + std::strlen(source);
+
+        if (!client::parse_fast(first, last, ast) || first != last)
+            return fail("Parsing failed, stopped at: \"" +
+                std::string(first, last) + "\"");
+
+        std::string error;
+
+        if (!program->threshold)
+        {
+            array_function array = compileNative(ast,
+                program->paramNames, program->optLevel, *program, true, error);
+
+            if (!array)
+                return fail(error);
+
+            // It's specialized from the optimized program, like the
+            // interpreter's, which gives the same answers
+            if (program->profile)
+            {
+                client::optimizeAST(ast, program->optimized);
+                program->profiling = true;
+            }
+
+            program->array.store(array, std::memory_order_release);
+            return program.release();
+        }
+
+        // To be interpreted first. Folding constants and sharing common
+        // subexpressions leaves the interpreter less to do, and the same
+        // program is compiled later so both give the same answers. Like
+        // with --optimize-ast, assignments the answer doesn't need are
+        // dropped along with any errors in them.
+        client::optimizeAST(ast, program->optimized);
+
+        if (!client::lowerBytecode(program->optimized, program->paramNames,
+                program->code, error))
+            return fail(error);
+
+        return program.release();
+    }
+
+    void* wwl_function(const wwl_program* program)
+    {
+        // The program only looks const to callers, since compiling it later
+        // doesn't change what it does
+        wwl_program* p = const_cast<wwl_program*>(program);
+
+        if (!p->array.load(std::memory_order_acquire))
+            compileNow(p);
+
+        if (!p->array.load(std::memory_order_acquire))
+        {
+            std::lock_guard<std::mutex> lock(p->mutex);
+            lastError = p->error;
+            return nullptr;
+        }
+
+        return p->function.load(std::memory_order_acquire);
+    }
+
+    size_t wwl_param_count(const wwl_program* program)
+    {
+        return program->params;
+    }
+
+    double wwl_call(const wwl_program* program, const double* args)
+    {
+        array_function array = program->array.load(std::memory_order_acquire);
+        wwl_program* p = const_cast<wwl_program*>(program);
+
+        if (array)
+        {
+            // Once the native code has been profiled for long enough, the
+            // call that stops the profiling queues it to be specialized
+            if (program->profiling.load(std::memory_order_relaxed) &&
+                program->profile->calls.load(std::memory_order_relaxed) >=
+                    program->specializeAfter &&
+                p->profiling.exchange(false))
+                backgroundCompiler().add(p, true);
+
+            return array(args);
+        }
+
+        // Only the call that reaches the threshold queues it to compile
+
+        if (p->calls.fetch_add(1, std::memory_order_relaxed) + 1 ==
+                p->threshold)
+            backgroundCompiler().add(p);
+
+        return client::interpret(program->code, args);
+    }
+
+    const char* wwl_error(void)
+    {
+        return lastError.c_str();
+    }
+
+    void wwl_free(wwl_program* program)
+    {
+        if (!program)
+            return;
+
+        // It can't be freed while it's being compiled or specialized
+        if ((program->threshold || program->profile) &&
+            !backgroundCompiler().cancel(program))
+        {
+            std::unique_lock<std::mutex> lock(program->mutex);
+            program->done.wait(lock, [program]() {
+                return !program->compiling;
+            });
+        }
+
+        // The specialized code calls the code from before, so it goes first
+        if (program->specializedTracker)
+            llvm::consumeError(program->specializedTracker->remove());
+
+        if (program->tracker)
+            llvm::consumeError(program->tracker->remove());
+
+        if (program->profiledTracker)
+            llvm::consumeError(program->profiledTracker->remove());
+
+        delete program;
+    }
+}
@@ -0,0 +1,153 @@
+/*
+ * WwuLang Compiler
+ *
+ * Library interface, for compiling programs from C or C++ and calling them
+ * directly as native functions. Link with -lwwulang.
+ *
+ * For example, to compile a program using variables x and y:
+ *
+ *   const char* params[] = { "x", "y", NULL };
+ *   wwl_program* program = wwl_compile("a=x*2;a+y", params, NULL);
+ *
+ *   if (!program)
+ *       fprintf(stderr, "%s\n", wwl_error());
+ *
+ *   double (*f)(double, double) =
+ *       (double (*)(double, double)) wwl_function(program);
+ *   double result = f(3, 4);
+ *
+ *   wwl_free(program);
+ */
+
+#ifndef WWULANG_H
+#define WWULANG_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A compiled program */
+typedef struct wwl_program wwl_program;
+
+typedef struct wwl_options
+{
+    /* 0 to 3, like the compiler's -O (default 2) */
+    unsigned int opt_level;
+
+    /*
+     * How many times wwl_call() runs the program with the interpreter
+     * before it's compiled to native code in the background, or 0 (the
+     * default) to compile it in wwl_compile(). Compiling takes far longer
+     * than interpreting the program once, so for programs that may only be
+     * called a few times this gets the first answer sooner, and the ones
+     * called often still end up native.
+     */
+    unsigned int jit_threshold;
+
+    /*
+     * How many times the native code is called through wwl_call() before
+     * it's compiled again in the background for the values its arguments
+     * nearly always have, or 0 (the default) to never do that. Until then
+     * the code records what the arguments are, which costs a little on
+     * each call. Any parameter that had the same value for about 95% of
+     * the calls becomes a constant, so e.g. a rate that never changes is
+     * folded into the code like a number in the source would be. The new
+     * code checks the arguments are those values first, and if not, calls
+     * the code from before, so the answers are always the same.
+     */
+    unsigned int specialize_after;
+} wwl_options;
+
+/* Fill in the default options */
+void wwl_default_options(wwl_options* opts);
+
+/*
+ * Compile the source code to a native function. param_names is a NULL
+ * terminated list of the variables the program uses that are given when
+ * calling it (or NULL if there aren't any), and opts may be NULL for the
+ * defaults.
+ *
+ * Returns NULL if it failed to compile, in which case wwl_error() says why.
+ * This can be called from multiple threads at once.
+ */
+wwl_program* wwl_compile(const char* source, const char* const* param_names,
+    const wwl_options* opts);
+
+/*
+ * The compiled function, taking the parameters in order as doubles and
+ * returning a double. Cast it to the right type before calling it, e.g.
+ * double (*)(double, double) for two parameters. It may be called from any
+ * number of threads at once, until the program is freed.
+ *
+ * If the program is still being interpreted (see jit_threshold), it's
+ * compiled now, and NULL is returned if that failed, in which case
+ * wwl_error() says why. This is never the specialized code (see
+ * specialize_after), which only wwl_call() switches to, but once the
+ * arguments have been profiled it's the same code without the profiling.
+ * Functions returned before then stay valid.
+ */
+void* wwl_function(const wwl_program* program);
+
+/* How many parameters the function takes */
+size_t wwl_param_count(const wwl_program* program);
+
+/*
+ * Call the function with the parameters in an array, for when the number of
+ * parameters isn't known when writing the code. Until the program has been
+ * compiled to native code, this runs it with the interpreter, which gives
+ * exactly the same answer.
+ */
+double wwl_call(const wwl_program* program, const double* args);
+
+/* Why the last wwl_compile() or wwl_function() on this thread failed */
+const char* wwl_error(void);
+
+/*
+ * Free the program's code, first waiting for it to finish compiling if
+ * that's happening in the background. Passing NULL does nothing.
+ */
+void wwl_free(wwl_program* program);
+
+#ifdef __cplusplus
+}
+
+namespace wwl
+{
+    // Frees the program when it goes out of scope
+    class program
+    {
+    public:
+        explicit program(wwl_program* compiled) : compiled(compiled) { }
+        ~program() { wwl_free(compiled); }
+
+        program(const program&) = delete;
+        program& operator=(const program&) = delete;
+
+        // Whether it compiled
+        explicit operator bool() const { return compiled != NULL; }
+
+        // Call it with the parameters in order, e.g. p(3.0, 4.0)
+        template <typename... Args>
+        double operator()(Args... args) const
+        {
+            typedef double (*function_type)(Args...);
+            return reinterpret_cast<function_type>(
+                wwl_function(compiled))(args...);
+        }
+
+        double call(const double* args) const
+        {
+            return wwl_call(compiled, args);
+        }
+
+        wwl_program* get() const { return compiled; }
+
+    private:
+        wwl_program* compiled;
+    };
+}
+#endif
+
+#endif